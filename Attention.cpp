@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Hardware.h"
+#include "Attention.h"
+#include "Hopper.h"
+#include <util/atomic.h>
+
+static volatile uint8_t mask;
+static volatile uint8_t pending;
+static uint8_t outputLevel;
+
+// Must be called with interrupts disabled
+static void updateOutput() {
+	uint8_t level;
+	if (mask)
+		level = (pending & mask) ? ATTENTION_ACTIVE : ATTENTION_IDLE;
+	else
+		level = hopper_empty ? HOPPER_EMPTY : HOPPER_FULL;
+
+	// Only write on changes, to keep this cheap when called
+	// from interrupts.
+	if (level != outputLevel) {
+		digitalWrite(H_Out, level);
+		outputLevel = level;
+	}
+}
+
+void attention_init()
+{
+	outputLevel = HOPPER_FULL;
+	digitalWrite(H_Out, outputLevel);
+	pinMode(H_Out, OUTPUT);
+}
+
+void attention_set_mask(uint8_t m)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		mask = m;
+		updateOutput();
+	}
+}
+
+uint8_t attention_get_mask()
+{
+	return mask;
+}
+
+uint8_t attention_get_pending()
+{
+	return pending;
+}
+
+void attention_raise(uint8_t sources)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		pending |= sources;
+		updateOutput();
+	}
+}
+
+void attention_clear(uint8_t sources)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		pending &= ~sources;
+		updateOutput();
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Normally, H_Out reflects the hopper state. In attention mode
+// (enabled by setting a non-zero mask), it is instead driven low when
+// any of the sources in the mask has something pending, and high when
+// the master has read everything. Sources are cleared when the master
+// reads the corresponding data.
+struct AttentionSources {
+	// New hopper measurement, cleared by GET_LAST_MEASUREMENT(_HIRES)
+	// and READ_HISTORY
+	static const uint8_t NEW_SAMPLE     = 0x01;
+	// Hopper empty/full state changed, cleared by GET_ATTENTION
+	static const uint8_t HOPPER_CHANGED = 0x02;
+	// Button event queued, cleared when GET_INPUT_EVENTS empties the
+	// queue
+	static const uint8_t BUTTON_EVENT   = 0x04;
+	// Encoder position changed, cleared by GET_ENCODER
+	static const uint8_t ENCODER_MOVED  = 0x08;
+};
+
+void attention_init();
+void attention_set_mask(uint8_t mask);
+uint8_t attention_get_mask();
+// Returns the pending sources (regardless of the mask)
+uint8_t attention_get_pending();
+
+// These can be called from interrupts
+void attention_raise(uint8_t sources);
+void attention_clear(uint8_t sources);
@@ -16,20 +16,61 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <avr/wdt.h>
-#include <util/crc16.h>
 #include "TwoWire.h"
 #include "BaseProtocol.h"
+#include "Crc8.h"
+#include "Profile.h"
 
-static uint8_t calcCrc(uint8_t *data, uint8_t len) {
-	uint8_t crc = 0xff;
-	for (uint8_t i = 0; i < len; ++i)
-		crc = _crc8_ccitt_update(crc, data[i]);
-	return crc;
+static const uint16_t STATS_MAGIC = 0x5354;
+static ProtocolStats stats __attribute__((section(".noinit")));
+
+static inline void count(uint16_t *counter) {
+	if (*counter != 0xffff)
+		++*counter;
+}
+
+static void clearStats() {
+	stats = ProtocolStats();
+	stats.magic = STATS_MAGIC;
+}
+
+void initProtocol() {
+	if (stats.magic != STATS_MAGIC)
+		clearStats();
+}
+
+ProtocolStats getProtocolStats() {
+	return stats;
 }
 
+// Reply to the last SEQUENCED request, excluding status and length
+static struct {
+	bool valid;
+	// Identifies the request: its sequence number, first command,
+	// length and CRC byte
+	uint8_t seq;
+	uint8_t cmd;
+	uint8_t requestLen;
+	uint8_t requestCrc;
+	uint8_t status;
+	uint8_t len;
+	TwoWireStreamProducer producer;
+	uint8_t data[TWI_BUFFER_SIZE - 2];
+} replyCache;
+
+// Everything that scales with TWI_BUFFER_SIZE: the request and reply
+// buffers of the TWI driver and the reply cache.
+static_assert(2 * TWI_BUFFER_SIZE + sizeof(replyCache) + TWI_RAM_RESERVE <= RAMEND - RAMSTART + 1, "TWI_BUFFER_SIZE too big for the available RAM");
+
 static int handleGeneralCall(uint8_t *data, uint8_t len, uint8_t /* maxLen */) {
+	// After a reset, the master may start counting sequence numbers
+	// from the beginning again, so never answer it from the cache
+	replyCache.valid = false;
+
 	if (len >= 1 && data[0] == GeneralCallCommands::RESET) {
+		count(&stats.resets);
 		wdt_enable(WDTO_15MS);
 		while(true) /* wait */;
 
@@ -39,25 +80,287 @@ static int handleGeneralCall(uint8_t *data, uint8_t len, uint8_t /* maxLen */) {
 	return 0;
 }
 
-int TwoWireCallback(uint8_t address, uint8_t *data, uint8_t len, uint8_t maxLen) {
+static cmd_result readRegs(uint8_t *datain, uint8_t /*len*/, uint8_t *dataout, uint8_t maxLen) {
+	uint8_t offset = datain[0];
+	uint8_t n = datain[1];
+	if (n > maxLen)
+		return cmd_result(Status::INVALID_ARGUMENTS);
+
+	RegisterWindow window(dataout, offset, n);
+	uint8_t size = readRegisterMap(window);
+	if (offset > size || n > size - offset)
+		return cmd_result(Status::INVALID_ARGUMENTS);
+
+	return cmd_ok(n);
+}
+
+static cmd_result readObjectPage(uint8_t *datain, uint8_t /*len*/, uint8_t *dataout, uint8_t maxLen) {
+	uint16_t offset = datain[1] << 8 | datain[2];
+	uint16_t size;
+	uint8_t n;
+	if (!readObject(datain[0], offset, dataout + 2, maxLen - 2, &n, &size))
+		return cmd_result(Status::INVALID_ARGUMENTS);
+
+	dataout[0] = size >> 8;
+	dataout[1] = size;
+	return cmd_ok(2 + n);
+}
+
+static cmd_result getBusErrors(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+	TwoWireErrors errors = TwoWireGetErrors();
+	dataout[0] = errors.busErrors >> 8;
+	dataout[1] = errors.busErrors;
+	dataout[2] = errors.collisions >> 8;
+	dataout[3] = errors.collisions;
+	dataout[4] = errors.timeouts >> 8;
+	dataout[5] = errors.timeouts;
+	return cmd_ok(6);
+}
+
+// Reply (all 16-bit big endian): ProtocolStats (without magic), then
+// the overflows and nackedReads fields of TwoWireErrors.
+static cmd_result getStats(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+	TwoWireErrors errors = TwoWireGetErrors();
+	const uint16_t values[] = {
+		stats.frames, stats.crcErrors, stats.shortFrames,
+		stats.unsupported, stats.resets,
+		errors.overflows, errors.nackedReads,
+	};
+	for (uint8_t i = 0; i < sizeof(values) / sizeof(*values); ++i) {
+		dataout[2 * i] = values[i] >> 8;
+		dataout[2 * i + 1] = values[i];
+	}
+	return cmd_ok(14);
+}
+
+static cmd_result clearAllStats(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t * /*dataout*/, uint8_t /*maxLen*/) {
+	clearStats();
+	TwoWireClearErrors();
+	return cmd_ok();
+}
+
+// BATCH and SEQUENCED are handled by processRequest() before the
+// table is consulted, so they only end up here when nested inside a
+// BATCH, which is not supported.
+static cmd_result notNestable(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t * /*dataout*/, uint8_t /*maxLen*/) {
+	return cmd_result(Status::COMMAND_NOT_SUPPORTED);
+}
+
+// Uses the command table, so defined below it
+static cmd_result getInfo(uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen);
+
+static constexpr Command protocolCommands[] PROGMEM = {
+	{ProtocolCommands::BATCH, 0, 255, 0, notNestable},
+	{ProtocolCommands::READ_REGS, 2, 2, 0, readRegs},
+	{ProtocolCommands::GET_INFO, 0, 0, 10, getInfo},
+	{ProtocolCommands::READ_OBJECT, 3, 3, 2, readObjectPage},
+	{ProtocolCommands::SEQUENCED, 0, 255, 0, notNestable},
+	{ProtocolCommands::GET_BUS_ERRORS, 0, 0, 6, getBusErrors},
+	{ProtocolCommands::GET_STATS, 0, 0, 14, getStats},
+	{ProtocolCommands::CLEAR_STATS, 0, 0, 0, clearAllStats},
+};
+
+static_assert(protocolCommands[0].opcode == ProtocolCommands::BATCH, "Protocol commands must start at BATCH");
+static_assert(commandsValid(protocolCommands), "Protocol commands must be consecutive");
+static_assert(2 + maxReplyLen(protocolCommands) <= TWI_BUFFER_SIZE, "TWI_BUFFER_SIZE too small for the protocol commands");
+
+static const size_t PROTOCOL_COMMAND_COUNT = sizeof(protocolCommands) / sizeof(*protocolCommands);
+static_assert(PROTOCOL_COMMAND_COUNT <= 16, "Protocol command bitmap is 16 bits");
+
+CommandTable protocolCommandTable() {
+	return {protocolCommands, PROTOCOL_COMMAND_COUNT};
+}
+
+// Bit n is set for opcode ProtocolCommands::BATCH + n
+static const uint16_t protocolCommandBitmap = (1UL << PROTOCOL_COMMAND_COUNT) - 1;
+
+// Reply (all big endian):
+//  - PROTOCOL_VERSION (1 byte)
+//  - FIRMWARE_BUILD_ID (2 bytes)
+//  - TWI_BUFFER_SIZE (1 byte). Replies can carry up to
+//    TWI_BUFFER_SIZE - 2 bytes of data (after the status and length,
+//    the CRC is not counted). Requests can be up to TWI_BUFFER_SIZE
+//    bytes, including the command and CRC.
+//  - Supported protocol commands, as a bitmap where bit n is
+//    ProtocolCommands::BATCH + n (2 bytes)
+//  - First application command and number of consecutive
+//    application commands (1 byte each)
+//  - FeatureFlags (1 byte)
+//  - CRC8_IMPLEMENTATION (1 byte)
+//  - Supported application commands, as a bitmap where bit n % 8 of
+//    byte n / 8 is the first application command + n. Commands that
+//    are not compiled in are left out. (1 byte per 8 commands)
+static cmd_result getInfo(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t maxLen) {
+	CommandTable table = commandTable();
+	uint8_t bitmapLen = (table.count + 7) / 8;
+	if (maxLen < 10 + bitmapLen)
+		return cmd_result(Status::INVALID_ARGUMENTS);
+
+	uint8_t first = table.count ? pgm_read_byte(&table.commands[0].opcode) : 0;
+	uint16_t buildId = FIRMWARE_BUILD_ID;
+	uint8_t features = 0;
+	#ifdef TWI_DEFER_CALLBACK
+	features |= FeatureFlags::DEFERRED_CALLBACK;
+	#endif
+
+	dataout[0] = PROTOCOL_VERSION;
+	dataout[1] = buildId >> 8;
+	dataout[2] = buildId;
+	dataout[3] = TWI_BUFFER_SIZE;
+	dataout[4] = protocolCommandBitmap >> 8;
+	dataout[5] = protocolCommandBitmap;
+	dataout[6] = first;
+	dataout[7] = table.count;
+	dataout[8] = features;
+	dataout[9] = CRC8_IMPLEMENTATION;
+
+	uint8_t *bitmap = dataout + 10;
+	memset(bitmap, 0, bitmapLen);
+	for (uint8_t i = 0; i < table.count; ++i) {
+		if (pgm_read_ptr(&table.commands[i].handler))
+			bitmap[i / 8] |= 1 << (i % 8);
+	}
+	return cmd_ok(10 + bitmapLen);
+}
+
+// Handles the commands implemented by BaseProtocol, or passes them on
+// to the application.
+static cmd_result processProtocolCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
+	cmd_result res = (uint8_t)(cmd - ProtocolCommands::BATCH) < PROTOCOL_COMMAND_COUNT
+		? dispatchCommand<ProtocolCommands::BATCH>(protocolCommands, cmd, datain, len, dataout, maxLen)
+		: processCommand(cmd, datain, len, dataout, maxLen);
+	if (res.status == Status::COMMAND_NOT_SUPPORTED)
+		count(&stats.unsupported);
+	return res;
+}
+
+// Runs the sub-commands of a BATCH request. The arguments consist of
+// any number of sub-commands, each formatted as the command byte, the
+// argument length and the arguments. The reply contains, for each
+// sub-command, its status, reply length and reply data.
+//
+// data is the full request (including BATCH and the CRC), replies are
+// written from data + 2 onwards.
+static cmd_result processBatch(uint8_t *data, uint8_t len, uint8_t maxLen) {
+	// Check the framing before running anything
+	uint8_t end = len - 1;
+	uint8_t pos = 1;
+	while (pos < end) {
+		if (end - pos < 2 || end - pos - 2 < data[pos + 1])
+			return cmd_result(Status::INVALID_ARGUMENTS);
+		pos += 2 + data[pos + 1];
+	}
+
+	// Move the sub-commands to the end of the buffer, so replies
+	// can be written from the start without overwriting sub-commands
+	// that were not processed yet. A reply can then use all space
+	// up to the arguments of its own sub-command.
+	uint8_t subLen = len - 2;
+	uint8_t in = maxLen - subLen;
+	memmove(data + in, data + 1, subLen);
+
+	uint8_t out = 2;
+	while (in < maxLen) {
+		uint8_t cmd = data[in];
+		uint8_t argLen = data[in + 1];
+		uint8_t args = in + 2;
+
+		cmd_result res = processProtocolCommand(cmd, data + args, argLen, data + out + 2, args - out - 2);
+		data[out] = res.status;
+		data[out + 1] = res.len;
+		out += 2 + res.len;
+		in = args + argLen;
+	}
+	return cmd_ok(out - 2);
+}
+
+static cmd_result processRequest(uint8_t *data, uint8_t len, uint8_t maxLen);
+
+// A SEQUENCED request wraps another request (including BATCH) after a
+// sequence number chosen by the master. When the sequence number, the
+// command, the length and the CRC are the same as for the previous
+// SEQUENCED request, the request is not run again, but the cached reply
+// is returned instead. This lets the master safely resend a request
+// when it could not read the reply, without running commands twice.
+// The master should use a different sequence number (e.g. increment
+// it) for every new request. The cache is cleared by general calls.
+//
+// Only the reply itself is cached. When the reply has a stream attached
+// (see TwoWireSetStreamProducer()), the same producer is attached again
+// on a retry, so the stream bytes are generated again from the current
+// data and can differ from the first attempt. The stream has its own
+// CRC, so the master can still check it.
+//
+// data is the full request (including SEQUENCED and the CRC), the reply
+// is written from data + 2 onwards.
+static cmd_result processSequenced(uint8_t *data, uint8_t len, uint8_t maxLen) {
+	// SEQUENCED, sequence number, command and CRC
+	if (len < 4 || data[2] == ProtocolCommands::SEQUENCED)
+		return cmd_result(Status::INVALID_ARGUMENTS);
+
+	uint8_t seq = data[1];
+	uint8_t cmd = data[2];
+	uint8_t crc = data[len - 1];
+	if (replyCache.valid && replyCache.seq == seq && replyCache.cmd == cmd &&
+	    replyCache.requestLen == len && replyCache.requestCrc == crc) {
+		memcpy(data + 2, replyCache.data, replyCache.len);
+		// Regenerates any stream from the current data
+		TwoWireSetStreamProducer(replyCache.producer);
+		return cmd_result(replyCache.status, replyCache.len);
+	}
+
+	// Strip the header and process the rest as a normal request
+	memmove(data, data + 2, len - 2);
+	cmd_result res = processRequest(data, len - 2, maxLen);
+
+	replyCache.valid = (res.status != Status::NO_REPLY);
+	replyCache.seq = seq;
+	replyCache.cmd = cmd;
+	replyCache.requestLen = len;
+	replyCache.requestCrc = crc;
+	replyCache.status = res.status;
+	replyCache.len = res.len;
+	replyCache.producer = TwoWireGetStreamProducer();
+	memcpy(replyCache.data, data + 2, res.len);
+	return res;
+}
+
+// Processes a request with a valid CRC. The reply data is written from
+// data + 2 onwards.
+static cmd_result processRequest(uint8_t *data, uint8_t len, uint8_t maxLen) {
+	if (data[0] == ProtocolCommands::BATCH)
+		return processBatch(data, len, maxLen);
+	if (data[0] == ProtocolCommands::SEQUENCED)
+		return processSequenced(data, len, maxLen);
+	return processProtocolCommand(data[0], data + 1, len - 2, data + 2, maxLen - 2);
+}
+
+int TwoWireCallback(uint8_t address, uint8_t *data, uint8_t len, uint8_t maxLen, uint8_t crc) {
+	count(&stats.frames);
 	if (address == 0)
 		return handleGeneralCall(data, len, maxLen);
 
-	// Check that there is at least room for a status byte and a CRC
+	// Check that there is at least room for a status and length
+	// byte (the CRC is added by the TWI code)
 	if (maxLen < 2)
 		return 0;
 
 	if (len < 2) {
+		count(&stats.shortFrames);
 		data[0] = Status::INVALID_TRANSFER;
 		len = 1;
 	} else {
-		uint8_t crc = calcCrc(data, len);
+		// The CRC was already calculated while receiving, including the
+		// CRC byte itself, so it is zero for a valid request.
 		if (crc != 0) {
+			count(&stats.crcErrors);
 			data[0] = Status::INVALID_CRC;
 			len = 1;
 		} else {
 			// CRC checks out, process a command
-			cmd_result res = processCommand(data[0], data + 1, len - 2, data + 2, maxLen - 3);
+			PROFILE_BEGIN(PROCESS_REQUEST);
+			cmd_result res = processRequest(data, len, maxLen);
+			PROFILE_END(PROCESS_REQUEST);
 			if (res.status == Status::NO_REPLY)
 				return 0;
 
@@ -69,10 +372,6 @@ int TwoWireCallback(uint8_t address, uint8_t *data, uint8_t len, uint8_t maxLen)
 	data[1] = len - 1;
 	++len;
 
-	data[len] = calcCrc(data, len);
-	++len;
-
-
 	return len;
 }
 
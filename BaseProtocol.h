@@ -18,6 +18,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
+#include <avr/pgmspace.h>
 
 struct Status {
 	static const uint8_t COMMAND_OK            = 0x00;
@@ -31,6 +33,52 @@ struct Status {
 	static const uint8_t NO_REPLY              = 0xff;
 };
 
+// Commands handled by BaseProtocol itself, before processCommand()
+struct ProtocolCommands {
+	// Runs multiple commands from a single request, see
+	// processBatch() in BaseProtocol.cpp for the format.
+	static const uint8_t BATCH = 0x70;
+	// Reads a block from the register map, see readRegisterMap().
+	// Arguments are the start offset and the number of bytes.
+	static const uint8_t READ_REGS = 0x71;
+	// Returns the protocol version, build and supported features,
+	// see getInfo() in BaseProtocol.cpp.
+	static const uint8_t GET_INFO = 0x72;
+	// Reads part of an object that can be bigger than a single
+	// reply, see readObject().  Arguments are the object id and a
+	// 16-bit offset. The reply is the 16-bit total size of the
+	// object, followed by as many bytes from the offset as fit. To
+	// read the full object, the master repeats this with the offset
+	// advanced by the number of bytes returned, until it reaches the
+	// size.
+	static const uint8_t READ_OBJECT = 0x73;
+	// Runs the request that follows a sequence number at most once,
+	// see processSequenced() in BaseProtocol.cpp.
+	static const uint8_t SEQUENCED = 0x74;
+	// Returns the TwoWireErrors counters (3 x 16 bits)
+	static const uint8_t GET_BUS_ERRORS = 0x75;
+	// Returns the protocol statistics, see getStats() in
+	// BaseProtocol.cpp
+	static const uint8_t GET_STATS = 0x76;
+	// Resets the statistics and the TwoWireErrors counters to zero
+	static const uint8_t CLEAR_STATS = 0x77;
+};
+
+// Incremented on incompatible changes to the framing or the commands
+// in ProtocolCommands.
+#define PROTOCOL_VERSION 1
+
+// Identifies the firmware build, set this from the build system
+#ifndef FIRMWARE_BUILD_ID
+#define FIRMWARE_BUILD_ID 0
+#endif
+
+// Feature flags returned by GET_INFO
+struct FeatureFlags {
+	// TWI_DEFER_CALLBACK is enabled
+	static const uint8_t DEFERRED_CALLBACK = 0x01;
+};
+
 struct GeneralCallCommands {
 	static const uint8_t RESET = 0x06;
 	static const uint8_t RESET_ADDRESS = 0x04;
@@ -46,4 +94,139 @@ inline cmd_result cmd_ok(uint8_t len = 0) {
 	return cmd_result(Status::COMMAND_OK, len);
 }
 
+// Largest register map supported, offsets are 8 bits
+#define REGISTER_MAP_MAX_SIZE 255
+
+// Protocol statistics, these saturate at 0xffff. These are not
+// cleared on a reset (only on power-up), so general call resets can be
+// counted.
+struct ProtocolStats {
+	// Marks the (uninitialized) stats as valid
+	uint16_t magic;
+	// Requests received, including general calls
+	uint16_t frames;
+	// Requests with an invalid CRC
+	uint16_t crcErrors;
+	// Requests too short to contain a command and CRC
+	uint16_t shortFrames;
+	// Commands answered with COMMAND_NOT_SUPPORTED
+	uint16_t unsupported;
+	// Resets requested by general call
+	uint16_t resets;
+};
+
+// Must be called at startup, before TwoWireInit()
+void initProtocol();
+
+// Returns a copy of the protocol statistics. The statistics are
+// updated while processing requests, so this should only be called
+// from command handlers or readRegisterMap().
+ProtocolStats getProtocolStats();
+
+// Writes the registers that fall inside a window of len bytes starting
+// at offset directly into a reply buffer, discarding everything else.
+// This lets any part of the map be read without building the full map
+// in RAM first, and nothing is ever written past dataout + len.
+class RegisterWindow {
+public:
+	RegisterWindow(uint8_t *dataout, uint8_t offset, uint8_t len)
+		: dataout(dataout), offset(offset), len(len) {}
+
+	// Writes the register at offset reg (big endian for put16)
+	void put8(uint8_t reg, uint8_t value) {
+		uint8_t i = reg - offset;
+		if (reg >= offset && i < len)
+			dataout[i] = value;
+	}
+
+	void put16(uint8_t reg, uint16_t value) {
+		put8(reg, value >> 8);
+		put8(reg + 1, value);
+	}
+
+private:
+	uint8_t *dataout;
+	uint8_t offset;
+	uint8_t len;
+};
+
+// Should be implemented by the application to write all registers in
+// its register map into window and return the size of the map (at most
+// REGISTER_MAP_MAX_SIZE). The map is a flat block of state that the
+// master can read any part of using READ_REGS. The first byte should
+// be a version number of the layout, which is incremented whenever
+// existing fields move or change meaning.
+uint8_t readRegisterMap(RegisterWindow &window);
+
+// Should be implemented by the application to read part of an object
+// for READ_OBJECT. Writes at most maxLen bytes starting at offset into
+// dataout (directly into the reply buffer), sets *len to the number of
+// bytes written (0 past the end) and *size to the total size of the
+// object. Returns false for unknown objects.
+bool readObject(uint8_t id, uint16_t offset, uint8_t *dataout, uint8_t maxLen, uint8_t *len, uint16_t *size);
+
 cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen);
+
+typedef cmd_result (*command_handler)(uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen);
+
+// Describes a command for dispatchCommand(). minLen and maxLen are the
+// allowed argument lengths, replyLen is the room the handler needs in
+// dataout. Handlers that fill as much as fits should use the maxLen
+// passed to them. A nullptr handler marks a command that is not
+// compiled in, which is answered with COMMAND_NOT_SUPPORTED.
+struct Command {
+	uint8_t opcode;
+	uint8_t minLen;
+	uint8_t maxLen;
+	uint8_t replyLen;
+	command_handler handler;
+};
+
+struct CommandTable {
+	// Command table in PROGMEM, with consecutive opcodes
+	const Command *commands;
+	uint8_t count;
+};
+
+// Should be implemented by the application to return the table of the
+// commands it supports in processCommand(), for GET_INFO.
+CommandTable commandTable();
+
+// Returns the table of the commands in ProtocolCommands. BATCH and
+// SEQUENCED are listed, but only handled at the top level of a request.
+CommandTable protocolCommandTable();
+
+// Checks that a command table lists consecutive opcodes, as required by
+// dispatchCommand().
+template <size_t N>
+constexpr bool commandsValid(const Command (&commands)[N], size_t i = 1) {
+	return i >= N || (commands[i].opcode == commands[0].opcode + i && commandsValid(commands, i + 1));
+}
+
+// Returns the largest replyLen in a command table. The TWI buffer must
+// hold this plus the status and length bytes (the reply CRC is not
+// stored in the buffer).
+template <size_t N>
+constexpr uint8_t maxReplyLen(const Command (&commands)[N], size_t i = 0) {
+	return i >= N ? 0 : commands[i].replyLen > maxReplyLen(commands, i + 1) ? commands[i].replyLen : maxReplyLen(commands, i + 1);
+}
+
+// Looks up a command in a table in PROGMEM by indexing it with the
+// opcode, checks the argument and reply lengths and calls its handler.
+// First must be the opcode of the first command.
+template <uint8_t First, size_t N>
+cmd_result dispatchCommand(const Command (&commands)[N], uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
+	uint8_t index = cmd - First;
+	if (index >= N)
+		return cmd_result(Status::COMMAND_NOT_SUPPORTED);
+
+	const Command *c = &commands[index];
+	command_handler handler = (command_handler)pgm_read_ptr(&c->handler);
+	if (!handler)
+		return cmd_result(Status::COMMAND_NOT_SUPPORTED);
+
+	if (len < pgm_read_byte(&c->minLen) || len > pgm_read_byte(&c->maxLen) || maxLen < pgm_read_byte(&c->replyLen))
+		return cmd_result(Status::INVALID_ARGUMENTS);
+
+	return handler(datain, len, dataout, maxLen);
+}
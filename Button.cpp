@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Hardware.h"
+#include "Button.h"
+#include "Attention.h"
+#include <util/atomic.h>
+
+static_assert(ENC_SW == PIN_A5, "Button pin changed");
+
+// Compiler barrier, to make sure an event is completely written
+// (resp. read) before the queue index that publishes (resp. frees)
+// it.
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+struct ButtonEvent {
+	uint8_t type;
+	uint16_t time;
+};
+
+// Lock-free single producer (button_update) single consumer
+// (button_read_events) queue. One slot is kept free to distinguish a
+// full queue from an empty one.
+#define QUEUE_SIZE 8
+static ButtonEvent queue[QUEUE_SIZE];
+static volatile uint8_t queueHead;
+static volatile uint8_t queueTail;
+static volatile bool queueOverflow;
+
+// Time of the last edge on the pin, set by the pin change interrupt
+static volatile uint16_t lastEdge;
+
+static bool pressed;
+static uint16_t pressTime;
+static bool longPressSent;
+static bool doubleClickSent;
+// Time of the last release that can be the first half of a double
+// click (i.e. not after a long press or a double click).
+static uint16_t releaseTime;
+static bool releaseValid;
+
+static void pushEvent(uint8_t type, uint16_t time)
+{
+	uint8_t head = queueHead;
+	uint8_t next = (head + 1) % QUEUE_SIZE;
+	if (next == queueTail) {
+		queueOverflow = true;
+		return;
+	}
+
+	queue[head].type = type;
+	queue[head].time = time;
+	barrier();
+	queueHead = next;
+	attention_raise(AttentionSources::BUTTON_EVENT);
+}
+
+static uint16_t now()
+{
+	return millis();
+}
+
+void button_init()
+{
+	pinMode(ENC_SW, INPUT_PULLUP);
+	pressed = (digitalRead(ENC_SW) == BUTTON_PRESSED);
+
+	lastEdge = now();
+	PCMSK0 |= _BV(PCINT5);
+	GIMSK |= _BV(PCIE0);
+}
+
+ISR(PCINT0_vect)
+{
+	lastEdge = now();
+}
+
+void button_update()
+{
+	uint16_t time = now();
+	bool level = (digitalRead(ENC_SW) == BUTTON_PRESSED);
+
+	uint16_t edge;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		edge = lastEdge;
+	}
+
+	// Accept a new state only once the pin is stable for long
+	// enough. Events are timestamped with the last edge, so loop
+	// latency does not affect them.
+	if (level != pressed && (uint16_t)(time - edge) >= BUTTON_DEBOUNCE_MS) {
+		pressed = level;
+		if (pressed) {
+			pushEvent(ButtonEvents::PRESS, edge);
+			doubleClickSent = releaseValid && (uint16_t)(edge - releaseTime) <= BUTTON_DOUBLE_CLICK_MS;
+			if (doubleClickSent)
+				pushEvent(ButtonEvents::DOUBLE_CLICK, edge);
+			pressTime = edge;
+			longPressSent = false;
+		} else {
+			pushEvent(ButtonEvents::RELEASE, edge);
+			releaseValid = !longPressSent && !doubleClickSent;
+			releaseTime = edge;
+		}
+	}
+
+	if (pressed && !longPressSent && (uint16_t)(time - pressTime) >= BUTTON_LONG_PRESS_MS) {
+		pushEvent(ButtonEvents::LONG_PRESS, pressTime + BUTTON_LONG_PRESS_MS);
+		longPressSent = true;
+	}
+}
+
+uint8_t button_read_events(uint8_t *dataout, uint8_t maxLen)
+{
+	if (maxLen < 1)
+		return 0;
+
+	uint8_t tail = queueTail;
+	uint8_t head = queueHead;
+	barrier();
+
+	uint8_t n = 0;
+	uint8_t *out = dataout + 1;
+	while (tail != head && 1 + (n + 1) * BUTTON_EVENT_SIZE <= maxLen) {
+		*out++ = queue[tail].type;
+		*out++ = queue[tail].time >> 8;
+		*out++ = queue[tail].time;
+		tail = (tail + 1) % QUEUE_SIZE;
+		++n;
+	}
+
+	barrier();
+	queueTail = tail;
+	if (tail == head)
+		attention_clear(AttentionSources::BUTTON_EVENT);
+
+	// Test and clear together, so an overflow flagged in between is
+	// not lost
+	bool overflow;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		overflow = queueOverflow;
+		queueOverflow = false;
+	}
+
+	dataout[0] = n;
+	if (overflow)
+		dataout[0] |= 0x80;
+	return 1 + n * BUTTON_EVENT_SIZE;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct ButtonEvents {
+	static const uint8_t PRESS        = 0x01;
+	static const uint8_t RELEASE      = 0x02;
+	// Sent once when the button is held for BUTTON_LONG_PRESS_MS,
+	// in addition to the PRESS and RELEASE events.
+	static const uint8_t LONG_PRESS   = 0x03;
+	// Sent on the second press within BUTTON_DOUBLE_CLICK_MS of
+	// the previous release, in addition to the PRESS event.
+	static const uint8_t DOUBLE_CLICK = 0x04;
+};
+
+#define BUTTON_DEBOUNCE_MS 10
+#define BUTTON_LONG_PRESS_MS 1000
+#define BUTTON_DOUBLE_CLICK_MS 300
+
+// Size of an event as returned by button_read_events(): type and
+// 16-bit big endian timestamp.
+#define BUTTON_EVENT_SIZE 3
+
+void button_init();
+// Debounces the button and generates events, should be called from
+// the main loop regularly.
+void button_update();
+
+// Removes as many events from the queue as fit into maxLen and writes
+// them into dataout, after a byte containing the number of events.
+// Bit 7 of that byte is set when events were dropped because the queue
+// was full. Returns the reply length.
+uint8_t button_read_events(uint8_t *dataout, uint8_t maxLen);
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+
+// Implementations of the CRC-8 (CCITT polynomial 0x07) update
+// function used for the TWI frames. They all produce the same result
+// (checked by make -C host check), but trade flash size for speed:
+//  - CRC8_BITWISE: avr-libc _crc8_ccitt_update, no table, a loop over
+//    the 8 bits
+//  - CRC8_NIBBLE: 16-byte table in flash, two lookups
+//  - CRC8_TABLE: 256-byte table in flash, a single lookup
+// crc8_update() uses the one selected by CRC8_IMPLEMENTATION.
+#define CRC8_BITWISE 0
+#define CRC8_NIBBLE 1
+#define CRC8_TABLE 2
+
+#ifndef CRC8_IMPLEMENTATION
+#define CRC8_IMPLEMENTATION CRC8_BITWISE
+#endif
+
+extern const uint8_t crc8_table[256] PROGMEM;
+extern const uint8_t crc8_nibble_table[16] PROGMEM;
+
+static inline uint8_t crc8_update_bitwise(uint8_t crc, uint8_t data) {
+	return _crc8_ccitt_update(crc, data);
+}
+
+static inline uint8_t crc8_update_nibble(uint8_t crc, uint8_t data) {
+	// Process the high nibble, then the low nibble
+	crc ^= data;
+	crc = (crc << 4) ^ pgm_read_byte(&crc8_nibble_table[crc >> 4]);
+	crc = (crc << 4) ^ pgm_read_byte(&crc8_nibble_table[crc >> 4]);
+	return crc;
+}
+
+static inline uint8_t crc8_update_table(uint8_t crc, uint8_t data) {
+	return pgm_read_byte(&crc8_table[crc ^ data]);
+}
+
+static inline uint8_t crc8_update(uint8_t crc, uint8_t data) {
+#if CRC8_IMPLEMENTATION == CRC8_TABLE
+	return crc8_update_table(crc, data);
+#elif CRC8_IMPLEMENTATION == CRC8_NIBBLE
+	return crc8_update_nibble(crc, data);
+#elif CRC8_IMPLEMENTATION == CRC8_BITWISE
+	return crc8_update_bitwise(crc, data);
+#else
+#error "Invalid CRC8_IMPLEMENTATION"
+#endif
+}
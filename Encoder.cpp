@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Hardware.h"
+#include "Encoder.h"
+#include "Attention.h"
+#include <util/atomic.h>
+
+// The ISR below reads both pins from PINB, and relies on these pin
+// change interrupt bits.
+static_assert(ENC_A == PIN_B2 && ENC_B == PIN_B1, "Encoder pins changed");
+static const uint8_t ENC_A_MASK = _BV(PINB2);
+static const uint8_t ENC_B_MASK = _BV(PINB1);
+
+// Change in position for each transition, indexed by the previous and
+// current pin state (each A << 1 | B). Invalid transitions (both pins
+// changed) count as no change.
+static const int8_t transitions[16] = {
+	 0, -1,  1,  0,
+	 1,  0,  0, -1,
+	-1,  0,  0,  1,
+	 0,  1, -1,  0,
+};
+
+static volatile int16_t position;
+static uint8_t lastState;
+static int16_t lastReadPosition;
+
+static uint8_t readState() {
+	uint8_t pins = PINB;
+	return ((pins & ENC_A_MASK) ? 2 : 0) | ((pins & ENC_B_MASK) ? 1 : 0);
+}
+
+void encoder_init()
+{
+	pinMode(ENC_A, INPUT_PULLUP);
+	pinMode(ENC_B, INPUT_PULLUP);
+
+	lastState = readState();
+	PCMSK1 |= _BV(PCINT10) | _BV(PCINT9);
+	GIMSK |= _BV(PCIE1);
+}
+
+ISR(PCINT1_vect)
+{
+	uint8_t state = readState();
+	int8_t change = transitions[lastState << 2 | state];
+	lastState = state;
+	if (change) {
+		position += change;
+		attention_raise(AttentionSources::ENCODER_MOVED);
+	}
+}
+
+int16_t encoder_get_position()
+{
+	int16_t p;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		p = position;
+	}
+	return p;
+}
+
+void encoder_read(int16_t *pos, int16_t *delta)
+{
+	int16_t p = encoder_get_position();
+	*pos = p;
+	*delta = p - lastReadPosition;
+	lastReadPosition = p;
+	attention_clear(AttentionSources::ENCODER_MOVED);
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+void encoder_init();
+
+// Returns the position of the encoder in quarter steps (four per detent)
+// and the change in position since the previous call. The position
+// wraps around at 16 bits, the delta is correct as long as it is called
+// at least every 32767 quarter steps.
+void encoder_read(int16_t *position, int16_t *delta);
+
+// Returns the position without affecting the delta returned by
+// encoder_read().
+int16_t encoder_get_position();
@@ -17,6 +17,8 @@
 
 #include "Arduino.h"
 
+//#define ENABLE_SERIAL
+
 static const int H_Led = PIN_A7;
 static const int H_Sens = PIN_A1;
 static const int H_Sens_ADC_Channel = 1;
@@ -40,4 +42,9 @@ static const int LED_OFF = LOW;
 static const int HOPPER_FULL = HIGH;
 static const int HOPPER_EMPTY = LOW;
 
+static const int BUTTON_PRESSED = LOW;
+
+static const int ATTENTION_ACTIVE = LOW;
+static const int ATTENTION_IDLE = HIGH;
+
 static const uint8_t I2C_ADDRESS = 8;
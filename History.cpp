@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Arduino.h"
+#include "History.h"
+#include <util/atomic.h>
+
+static_assert((HISTORY_SIZE & (HISTORY_SIZE - 1)) == 0, "HISTORY_SIZE must be a power of two");
+
+struct HistorySample {
+	uint16_t on;
+	uint16_t off;
+	uint16_t time;
+};
+
+static HistorySample samples[HISTORY_SIZE];
+// Sequence number of the next sample to be added
+static uint16_t nextSeq;
+// Number of valid samples, until the buffer fills up
+static uint8_t count;
+
+void history_add(uint16_t on, uint16_t off)
+{
+	uint16_t time = millis();
+	// Readers might run from an interrupt, so never let them see a
+	// partially written sample.
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		HistorySample& s = samples[nextSeq % HISTORY_SIZE];
+		s.on = on;
+		s.off = off;
+		s.time = time;
+		++nextSeq;
+		if (count < HISTORY_SIZE)
+			++count;
+	}
+}
+
+uint8_t history_read(uint16_t seq, uint8_t *dataout, uint8_t maxLen)
+{
+	if (maxLen < 3)
+		return 0;
+
+	uint8_t n = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint16_t available = nextSeq - seq;
+		if (available > count) {
+			// Requested samples were overwritten (or are
+			// not there yet), start at the oldest one.
+			seq = nextSeq - count;
+			available = count;
+		}
+
+		n = (maxLen - 3) / HISTORY_SAMPLE_SIZE;
+		if (n > available)
+			n = available;
+
+		dataout[0] = seq >> 8;
+		dataout[1] = seq;
+		dataout[2] = n;
+		uint8_t *out = dataout + 3;
+		for (uint8_t i = 0; i < n; ++i) {
+			const HistorySample& s = samples[(uint16_t)(seq + i) % HISTORY_SIZE];
+			*out++ = s.on >> 8;
+			*out++ = s.on;
+			*out++ = s.off >> 8;
+			*out++ = s.off;
+			*out++ = s.time >> 8;
+			*out++ = s.time;
+		}
+	}
+	return 3 + n * HISTORY_SAMPLE_SIZE;
+}
+
+uint16_t history_get_next_seq()
+{
+	uint16_t seq;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		seq = nextSeq;
+	}
+	return seq;
+}
+
+// Must be called with interrupts disabled
+static uint8_t rawByte(uint16_t offset)
+{
+	uint8_t slot = offset / HISTORY_RAW_ENTRY_SIZE;
+	uint8_t field = offset % HISTORY_RAW_ENTRY_SIZE;
+	if (slot >= count)
+		return 0xff;
+
+	const HistorySample& s = samples[slot];
+	uint16_t value;
+	switch (field / 2) {
+		case 0:
+			// Most recent sequence number stored in this slot
+			value = nextSeq - 1 - (uint16_t)(nextSeq - 1 - slot) % HISTORY_SIZE;
+			break;
+		case 1: value = s.on; break;
+		case 2: value = s.off; break;
+		default: value = s.time; break;
+	}
+	return (field & 1) ? value : value >> 8;
+}
+
+uint8_t history_read_raw(uint16_t offset, uint8_t *dataout, uint8_t len)
+{
+	if (offset >= HISTORY_RAW_SIZE)
+		return 0;
+	if (len > HISTORY_RAW_SIZE - offset)
+		len = HISTORY_RAW_SIZE - offset;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		for (uint8_t i = 0; i < len; ++i)
+			dataout[i] = rawByte(offset + i);
+	}
+	return len;
+}
+
+bool history_stream_raw(uint16_t pos, uint8_t *data)
+{
+	if (pos >= HISTORY_RAW_SIZE)
+		return false;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*data = rawByte(pos);
+	}
+	return true;
+}
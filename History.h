@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Number of samples kept, must be a power of two. Each sample takes
+// 6 bytes of RAM.
+#define HISTORY_SIZE 16
+
+// Size of a sample as returned by history_read(): on, off and
+// timestamp, all 16-bit big endian.
+#define HISTORY_SAMPLE_SIZE 6
+
+// Adds a sample, overwriting the oldest one when the history is full.
+// The timestamp is the low 16 bits of millis().
+void history_add(uint16_t on, uint16_t off);
+
+// Writes as many samples as fit in maxLen into dataout, starting at
+// sequence number seq (which counts all samples ever added, wrapping
+// at 2^16). The reply starts with the 16-bit sequence number of the
+// first sample returned and the number of samples returned. When seq
+// was already overwritten, this starts at the oldest sample instead,
+// so the master can see how many samples were lost. Returns the reply
+// length.
+uint8_t history_read(uint16_t seq, uint8_t *dataout, uint8_t maxLen);
+
+// Size of a slot in the raw history, as returned by history_read_raw():
+// sequence number, on, off and timestamp, all 16-bit big endian.
+#define HISTORY_RAW_ENTRY_SIZE 8
+#define HISTORY_RAW_SIZE (HISTORY_SIZE * HISTORY_RAW_ENTRY_SIZE)
+
+// Reads up to len bytes of the raw history, starting at offset, into
+// dataout and returns the number of bytes read. The raw history is
+// the sample buffer in storage order, including the sequence number of
+// each sample, so it can be read in parts while new samples come in.
+// Slots that were never written read as all 0xff.
+uint8_t history_read_raw(uint16_t offset, uint8_t *dataout, uint8_t len);
+
+// TwoWireStreamProducer for the raw history. Since bytes are produced
+// while they are sent, a sample added during the transfer can be
+// streamed partly, so the master should discard the slot whose
+// sequence number is the highest.
+bool history_stream_raw(uint16_t pos, uint8_t *data);
+
+// Returns the sequence number the next sample will get
+uint16_t history_get_next_seq();
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Hardware.h"
+#include "Hopper.h"
+#include "History.h"
+#include "Attention.h"
+#include "Scheduler.h"
+#include <util/atomic.h>
+#include <avr/sleep.h>
+
+const uint16_t hopper_threshold = 20;
+uint16_t measurement[2];
+uint16_t measurement_hires[2];
+uint8_t measurement_bits = 10;
+bool hopper_empty = false;
+
+static uint8_t oversampling = 0;
+
+static HopperTiming timing = {
+	/* settle_on_ms */ 10,
+	/* settle_off_ms */ 10,
+	/* period_ms */ 20,
+};
+
+#ifndef ENABLE_SERIAL // Serial reuses the H_sens pin
+
+// Timer2 runs freely at F_CPU / 64, its compare match A interrupt is
+// used as a one-shot timer for the measurement steps.
+static const uint16_t TIMER_TICKS_PER_MS = F_CPU / 64 / 1000;
+// Longest time to wait with a single compare match
+static const uint16_t TIMER_MAX_STEP = 0x8000;
+
+static volatile uint32_t timerRemaining;
+// Set by the timer or ADC interrupt when the current step is done
+static volatile bool stepDue;
+// Sum of the samples taken in the current step, and the number of
+// samples still to be taken.
+static volatile uint16_t adcSum;
+static volatile uint8_t adcSamplesLeft;
+
+enum HopperState {
+	// Waiting for the next measurement to start
+	HopperStateWait,
+	// LED is on, waiting to settle
+	HopperStateSettleOn,
+	// LED is on, sampling
+	HopperStateConvertOn,
+	// LED is off, waiting to settle
+	HopperStateSettleOff,
+	// LED is off, sampling
+	HopperStateConvertOff,
+};
+
+static HopperState state = HopperStateWait;
+static unsigned long cycleStart;
+static uint8_t cycleOversampling;
+// Whether the current cycle uses ADC noise reduction sleep
+static bool cycleNoiseReduction;
+static uint16_t lastOn;
+
+static void startTimer(uint16_t ms) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		stepDue = false;
+		timerRemaining = (uint32_t)ms * TIMER_TICKS_PER_MS;
+		// Let the first compare match happen right away, the
+		// ISR then handles the remaining time. TCNT2 might tick
+		// once (but not twice, with prescaler 64) between the
+		// read and the write, so use a margin of 2 to not miss
+		// the match.
+		OCR2A = TCNT2 + 2;
+		TIFR2 = _BV(OCF2A);
+		TIMSK2 |= _BV(OCIE2A);
+	}
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+	uint32_t remaining = timerRemaining;
+	if (remaining == 0) {
+		TIMSK2 &= ~_BV(OCIE2A);
+		stepDue = true;
+		scheduler_wake();
+		return;
+	}
+
+	uint16_t step = remaining > TIMER_MAX_STEP ? TIMER_MAX_STEP : remaining;
+	OCR2A += step;
+	timerRemaining = remaining - step;
+}
+
+static void startConversion() {
+	stepDue = false;
+	adcSum = 0;
+	adcSamplesLeft = 1 << (2 * cycleOversampling);
+	if (cycleNoiseReduction) {
+		// The conversion is started by entering sleep in
+		// waitForConversion(), on the next hopper_update()
+		scheduler_wake();
+	} else {
+		ADCSRA |= _BV(ADSC);
+	}
+}
+
+#ifdef HOPPER_ADC_NOISE_REDUCTION
+static void waitForConversion() {
+	// Entering ADC noise reduction sleep starts a conversion. When
+	// another interrupt wakes us up before it completes, sleep
+	// again, which does not restart the running conversion.
+	set_sleep_mode(SLEEP_MODE_ADC);
+	cli();
+	while (!stepDue) {
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		cli();
+	}
+	sei();
+}
+#endif
+
+ISR(ADC_vect)
+{
+	adcSum += ADC;
+	// Start the next conversion right away when oversampling
+	if (--adcSamplesLeft) {
+		ADCSRA |= _BV(ADSC);
+	} else {
+		stepDue = true;
+		scheduler_wake();
+	}
+}
+
+static void publish(uint16_t onSum, uint16_t offSum)
+{
+	// Summing 4^n samples adds 2n bits, decimating by 2^n leaves n
+	// extra bits of resolution.
+	uint8_t n = cycleOversampling;
+	uint16_t on = onSum >> (2 * n);
+	uint16_t off = offSum >> (2 * n);
+
+	// Store the raw measurements to be read through I²C
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		measurement[0] = on;
+		measurement[1] = off;
+		measurement_hires[0] = onSum >> n;
+		measurement_hires[1] = offSum >> n;
+		measurement_bits = 10 + n;
+	}
+	history_add(on, off);
+
+	// Lower reading means more light
+	uint8_t sources = AttentionSources::NEW_SAMPLE;
+	bool empty = (on < off && (off - on) > hopper_threshold);
+	if (empty != hopper_empty) {
+		hopper_empty = empty;
+		sources |= AttentionSources::HOPPER_CHANGED;
+	}
+	// This also updates H_Out when not in attention mode
+	attention_raise(sources);
+}
+
+void hopper_init()
+{
+	TCCR2A = 0;
+	TCCR2B = _BV(CS21) | _BV(CS20);
+
+	// Use VCC as reference, and an ADC clock of F_CPU / 64 (125kHz
+	// at 8Mhz, within the 50-200kHz range needed for full
+	// resolution).
+	ADMUXA = H_Sens_ADC_Channel;
+	ADMUXB = 0;
+	ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1);
+
+	state = HopperStateWait;
+	startTimer(0);
+}
+
+void hopper_update()
+{
+#ifdef HOPPER_ADC_NOISE_REDUCTION
+	if (cycleNoiseReduction && (state == HopperStateConvertOn || state == HopperStateConvertOff))
+		waitForConversion();
+#endif
+
+	if (!stepDue)
+		return;
+
+	HopperTiming t = hopper_get_timing();
+	switch (state) {
+		case HopperStateWait:
+			cycleStart = millis();
+			cycleOversampling = oversampling;
+#ifdef HOPPER_ADC_NOISE_REDUCTION
+			// Oversampling averages out the noise instead,
+			// and sleeping for all 4^n conversions would
+			// block the loop and stop the timers for too long.
+			cycleNoiseReduction = (cycleOversampling == 0);
+#endif
+			digitalWrite(H_Led, LED_ON);
+			state = HopperStateSettleOn;
+			startTimer(t.settle_on_ms);
+			break;
+
+		case HopperStateSettleOn:
+			state = HopperStateConvertOn;
+			startConversion();
+			break;
+
+		case HopperStateConvertOn:
+			lastOn = adcSum;
+			digitalWrite(H_Led, LED_OFF);
+			state = HopperStateSettleOff;
+			startTimer(t.settle_off_ms);
+			break;
+
+		case HopperStateSettleOff:
+			state = HopperStateConvertOff;
+			startConversion();
+			break;
+
+		case HopperStateConvertOff: {
+			publish(lastOn, adcSum);
+
+			unsigned long elapsed = millis() - cycleStart;
+			state = HopperStateWait;
+			startTimer(elapsed < t.period_ms ? t.period_ms - elapsed : 0);
+			break;
+		}
+	}
+}
+
+#else
+
+void hopper_init() { }
+void hopper_update() { }
+
+#endif
+
+void hopper_set_timing(const HopperTiming& t)
+{
+	// New timing applies from the next step
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		timing = t;
+	}
+}
+
+HopperTiming hopper_get_timing()
+{
+	HopperTiming t;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		t = timing;
+	}
+	return t;
+}
+
+bool hopper_set_oversampling(uint8_t n)
+{
+	if (n > HOPPER_MAX_OVERSAMPLING)
+		return false;
+	// Applies from the next measurement
+	oversampling = n;
+	return true;
+}
+
+uint8_t hopper_get_oversampling()
+{
+	return oversampling;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// When defined, the CPU sleeps in ADC noise reduction mode while the
+// hopper sensor is sampled without oversampling, to reduce noise from
+// the CPU. The loop is then blocked for the duration of a conversion
+// (13 ADC clocks, 104μs at 125kHz), though interrupts are still
+// handled. Timers (including millis()) are stopped in this sleep mode,
+// so they lose about 0.2ms per measurement, which skews everything
+// based on millis() (history timestamps, task periods, button timing
+// and TWI timeouts). Off by default for that reason. With
+// oversampling, the conversions run in the background instead.
+//#define HOPPER_ADC_NOISE_REDUCTION
+
+struct HopperTiming {
+	// Time to wait after switching the LED on resp. off, before
+	// sampling the sensor.
+	uint16_t settle_on_ms;
+	uint16_t settle_off_ms;
+	// Time between the start of subsequent measurements. When this
+	// is shorter than a measurement takes, a new measurement starts
+	// right away.
+	uint16_t period_ms;
+};
+
+// Maximum oversampling setting, which takes 4^3 = 64 samples per phase.
+// More would overflow the 16-bit sum.
+#define HOPPER_MAX_OVERSAMPLING 3
+
+// Minimum difference between the off and on measurement (10-bit) for
+// the hopper to be considered empty.
+extern const uint16_t hopper_threshold;
+
+// Last measurement, with the LED on and off respectively, as 10-bit
+// values.
+extern uint16_t measurement[2];
+// The same measurement, at the resolution of the oversampling setting
+// that was used for it (measurement_bits, 10-13 bits).
+extern uint16_t measurement_hires[2];
+extern uint8_t measurement_bits;
+// Hopper state derived from the last measurement
+extern bool hopper_empty;
+
+void hopper_init();
+// Advances the measurement when a step is due. Never blocks (except
+// for ADC noise reduction), steps are triggered by interrupts that call
+// scheduler_wake(), so this should run as a period 0 task.
+void hopper_update();
+
+void hopper_set_timing(const HopperTiming& timing);
+HopperTiming hopper_get_timing();
+
+// With oversampling n, 4^n samples are taken for each measurement
+// phase, and decimated into a 10 + n bit result. Returns false when n
+// is out of range.
+bool hopper_set_oversampling(uint8_t n);
+uint8_t hopper_get_oversampling();
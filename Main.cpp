@@ -19,34 +19,311 @@
 #include "Arduino.h"
 #include "TwoWire.h"
 #include "BaseProtocol.h"
+#include "Hopper.h"
+#include "History.h"
+#include "Encoder.h"
+#include "Button.h"
+#include "Attention.h"
+#include "Profile.h"
+#include "Scheduler.h"
 #include <util/atomic.h>
 
-const uint16_t hopper_threshold = 20;
-uint16_t measurement[2];
-
-//#define ENABLE_SERIAL
-
 struct Commands {
   enum {
     GET_LAST_MEASUREMENT = 0x80,
+    SET_HOPPER_TIMING = 0x81,
+    GET_HOPPER_TIMING = 0x82,
+    GET_LAST_MEASUREMENT_HIRES = 0x83,
+    SET_OVERSAMPLING = 0x84,
+    READ_HISTORY = 0x85,
+    GET_ENCODER = 0x86,
+    GET_INPUT_EVENTS = 0x87,
+    SET_ATTENTION_MASK = 0x88,
+    GET_ATTENTION = 0x89,
+    STREAM_HISTORY = 0x8A,
+    PROFILE_DUMP = 0x8B,
+    PROFILE_CLEAR = 0x8C,
+    GET_TASK_OVERRUNS = 0x8D,
   };
 };
 
-cmd_result processCommand(uint8_t cmd, uint8_t * /*datain*/, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
-  switch (cmd) {
-    case Commands::GET_LAST_MEASUREMENT:
-      if (len != 0 || maxLen < 4)
-        return cmd_result(Status::INVALID_ARGUMENTS);
-      dataout[0] = measurement[0] >> 8;
-      dataout[1] = measurement[0];
-      dataout[2] = measurement[1] >> 8;
-      dataout[3] = measurement[1];
-      return cmd_result(Status::COMMAND_OK, 4);
+static cmd_result get_last_measurement(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+  dataout[0] = measurement[0] >> 8;
+  dataout[1] = measurement[0];
+  dataout[2] = measurement[1] >> 8;
+  dataout[3] = measurement[1];
+  attention_clear(AttentionSources::NEW_SAMPLE);
+  return cmd_ok(4);
+}
+
+static cmd_result set_hopper_timing(uint8_t *datain, uint8_t /*len*/, uint8_t * /*dataout*/, uint8_t /*maxLen*/) {
+  HopperTiming timing;
+  timing.settle_on_ms = datain[0] << 8 | datain[1];
+  timing.settle_off_ms = datain[2] << 8 | datain[3];
+  timing.period_ms = datain[4] << 8 | datain[5];
+  hopper_set_timing(timing);
+  return cmd_ok();
+}
+
+static cmd_result get_hopper_timing(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+  HopperTiming timing = hopper_get_timing();
+  dataout[0] = timing.settle_on_ms >> 8;
+  dataout[1] = timing.settle_on_ms;
+  dataout[2] = timing.settle_off_ms >> 8;
+  dataout[3] = timing.settle_off_ms;
+  dataout[4] = timing.period_ms >> 8;
+  dataout[5] = timing.period_ms;
+  return cmd_ok(6);
+}
+
+static cmd_result get_last_measurement_hires(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+  dataout[0] = measurement_bits;
+  dataout[1] = measurement_hires[0] >> 8;
+  dataout[2] = measurement_hires[0];
+  dataout[3] = measurement_hires[1] >> 8;
+  dataout[4] = measurement_hires[1];
+  attention_clear(AttentionSources::NEW_SAMPLE);
+  return cmd_ok(5);
+}
+
+static cmd_result set_oversampling(uint8_t *datain, uint8_t /*len*/, uint8_t * /*dataout*/, uint8_t /*maxLen*/) {
+  if (!hopper_set_oversampling(datain[0]))
+    return cmd_result(Status::INVALID_ARGUMENTS);
+  return cmd_ok();
+}
+
+static cmd_result read_history(uint8_t *datain, uint8_t /*len*/, uint8_t *dataout, uint8_t maxLen) {
+  attention_clear(AttentionSources::NEW_SAMPLE);
+  return cmd_ok(history_read(datain[0] << 8 | datain[1], dataout, maxLen));
+}
+
+static cmd_result get_encoder(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+  int16_t position, delta;
+  encoder_read(&position, &delta);
+  dataout[0] = position >> 8;
+  dataout[1] = position;
+  dataout[2] = delta >> 8;
+  dataout[3] = delta;
+  return cmd_ok(4);
+}
+
+static cmd_result get_input_events(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t maxLen) {
+  return cmd_ok(button_read_events(dataout, maxLen));
+}
+
+static cmd_result set_attention_mask(uint8_t *datain, uint8_t /*len*/, uint8_t * /*dataout*/, uint8_t /*maxLen*/) {
+  attention_set_mask(datain[0]);
+  return cmd_ok();
+}
+
+static cmd_result get_attention(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+  dataout[0] = attention_get_pending();
+  dataout[1] = hopper_empty;
+  attention_clear(AttentionSources::HOPPER_CHANGED);
+  return cmd_ok(2);
+}
+
+#ifdef ENABLE_PROFILING
+// Arguments: index of the first task to return. See profile_dump()
+// for the reply.
+static cmd_result profile_dump_cmd(uint8_t *datain, uint8_t /*len*/, uint8_t *dataout, uint8_t maxLen) {
+  return cmd_ok(profile_dump(datain[0], dataout, maxLen));
+}
+
+static cmd_result profile_clear_cmd(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t * /*dataout*/, uint8_t /*maxLen*/) {
+  profile_clear();
+  return cmd_ok();
+}
+#else
+// Not compiled in, so answered with COMMAND_NOT_SUPPORTED and left out
+// of GET_INFO
+static const command_handler profile_dump_cmd = nullptr;
+static const command_handler profile_clear_cmd = nullptr;
+#endif
+
+// Tasks run from loop(), in this order. Tasks with period 0 are woken
+// up by interrupts (using scheduler_wake()).
+static constexpr Task tasks[] PROGMEM = {
+  // run              period_ms  profileTask
+  {TwoWirePoll,       0,         ProfileTasks::TWI_POLL},
+  {hopper_update,     0,         ProfileTasks::HOPPER_UPDATE},
+  // Events are timestamped by the pin change interrupt, so polling
+  // does not need to be fast.
+  {button_update,     5,         ProfileTasks::BUTTON_UPDATE},
+};
+
+static TaskState taskStates[sizeof(tasks) / sizeof(*tasks)];
+
+// Returns the number of tasks, followed by the overrun count of each
+// task (16 bit).
+static cmd_result get_task_overruns(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+  uint8_t count = sizeof(tasks) / sizeof(*tasks);
+  dataout[0] = count;
+  for (uint8_t i = 0; i < count; ++i) {
+    uint16_t overruns;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      overruns = taskStates[i].overruns;
+    }
+    dataout[1 + 2 * i] = overruns >> 8;
+    dataout[2 + 2 * i] = overruns;
+  }
+  return cmd_ok(1 + 2 * count);
+}
+
+// Objects that can be read using READ_OBJECT
+struct Objects {
+  enum {
+    // See history_read_raw()
+    HISTORY = 0x00,
+    // The full register map, as for READ_REGS
+    REGISTER_MAP = 0x01,
+  };
+};
+
+// Replies with the size of the raw history, which is then streamed
+// after the reply (see TwoWireSetStreamProducer()). This returns the
+// same data as reading the HISTORY object, but in a single transfer.
+static cmd_result stream_history(uint8_t * /*datain*/, uint8_t /*len*/, uint8_t *dataout, uint8_t /*maxLen*/) {
+  TwoWireSetStreamProducer(history_stream_raw);
+  attention_clear(AttentionSources::NEW_SAMPLE);
+  dataout[0] = HISTORY_RAW_SIZE >> 8;
+  dataout[1] = HISTORY_RAW_SIZE & 0xff;
+  return cmd_ok(2);
+}
+
+// Offsets of the fields in the register map, all multi-byte fields are
+// big endian. Increment REGISTER_MAP_VERSION when existing fields
+// change.
+struct Registers {
+  enum {
+    // REGISTER_MAP_VERSION (1 byte)
+    VERSION = 0,
+    // Status flags, bit 0: hopper empty (1 byte)
+    STATUS = 1,
+    // Pending attention sources (1 byte)
+    ATTENTION_PENDING = 2,
+    // Attention mask (1 byte)
+    ATTENTION_MASK = 3,
+    // Last measurement, LED on and off (2 x 2 bytes)
+    MEASUREMENT = 4,
+    // Bits in hires measurement (1 byte)
+    MEASUREMENT_BITS = 8,
+    // Last hires measurement, LED on and off (2 x 2 bytes)
+    MEASUREMENT_HIRES = 9,
+    // Hopper empty threshold (2 bytes)
+    HOPPER_THRESHOLD = 13,
+    // Settle time LED on, settle time LED off and measurement
+    // period in ms (3 x 2 bytes)
+    HOPPER_TIMING = 15,
+    // Oversampling setting (1 byte)
+    OVERSAMPLING = 21,
+    // Encoder position (2 bytes)
+    ENCODER_POSITION = 22,
+    // Next history sequence number (2 bytes)
+    HISTORY_NEXT_SEQ = 24,
+    // ProtocolStats frames, crcErrors, shortFrames, unsupported
+    // and resets (5 x 2 bytes)
+    PROTOCOL_STATS = 26,
+    // TwoWireErrors busErrors, collisions, timeouts, overflows and
+    // nackedReads (5 x 2 bytes)
+    BUS_ERRORS = 36,
+    SIZE = 46,
+  };
+};
+
+const uint8_t REGISTER_MAP_VERSION = 1;
+const uint8_t REGISTER_MAP_SIZE = Registers::SIZE;
+static_assert(REGISTER_MAP_SIZE <= REGISTER_MAP_MAX_SIZE, "Register map too big");
+
+uint8_t readRegisterMap(RegisterWindow &window) {
+  HopperTiming timing = hopper_get_timing();
+  ProtocolStats stats = getProtocolStats();
+  TwoWireErrors errors = TwoWireGetErrors();
+
+  window.put8(Registers::VERSION, REGISTER_MAP_VERSION);
+  window.put8(Registers::STATUS, hopper_empty ? 1 : 0);
+  window.put8(Registers::ATTENTION_PENDING, attention_get_pending());
+  window.put8(Registers::ATTENTION_MASK, attention_get_mask());
+  window.put16(Registers::MEASUREMENT, measurement[0]);
+  window.put16(Registers::MEASUREMENT + 2, measurement[1]);
+  window.put8(Registers::MEASUREMENT_BITS, measurement_bits);
+  window.put16(Registers::MEASUREMENT_HIRES, measurement_hires[0]);
+  window.put16(Registers::MEASUREMENT_HIRES + 2, measurement_hires[1]);
+  window.put16(Registers::HOPPER_THRESHOLD, hopper_threshold);
+  window.put16(Registers::HOPPER_TIMING, timing.settle_on_ms);
+  window.put16(Registers::HOPPER_TIMING + 2, timing.settle_off_ms);
+  window.put16(Registers::HOPPER_TIMING + 4, timing.period_ms);
+  window.put8(Registers::OVERSAMPLING, hopper_get_oversampling());
+  window.put16(Registers::ENCODER_POSITION, encoder_get_position());
+  window.put16(Registers::HISTORY_NEXT_SEQ, history_get_next_seq());
+  window.put16(Registers::PROTOCOL_STATS, stats.frames);
+  window.put16(Registers::PROTOCOL_STATS + 2, stats.crcErrors);
+  window.put16(Registers::PROTOCOL_STATS + 4, stats.shortFrames);
+  window.put16(Registers::PROTOCOL_STATS + 6, stats.unsupported);
+  window.put16(Registers::PROTOCOL_STATS + 8, stats.resets);
+  window.put16(Registers::BUS_ERRORS, errors.busErrors);
+  window.put16(Registers::BUS_ERRORS + 2, errors.collisions);
+  window.put16(Registers::BUS_ERRORS + 4, errors.timeouts);
+  window.put16(Registers::BUS_ERRORS + 6, errors.overflows);
+  window.put16(Registers::BUS_ERRORS + 8, errors.nackedReads);
+  return REGISTER_MAP_SIZE;
+}
+
+bool readObject(uint8_t id, uint16_t offset, uint8_t *dataout, uint8_t maxLen, uint8_t *len, uint16_t *size) {
+  switch (id) {
+    case Objects::HISTORY:
+      *size = HISTORY_RAW_SIZE;
+      *len = history_read_raw(offset, dataout, maxLen);
+      return true;
+    case Objects::REGISTER_MAP: {
+      *size = REGISTER_MAP_SIZE;
+      *len = 0;
+      if (offset < REGISTER_MAP_SIZE) {
+        *len = REGISTER_MAP_SIZE - offset;
+        if (*len > maxLen)
+          *len = maxLen;
+        RegisterWindow window(dataout, offset, *len);
+        readRegisterMap(window);
+      }
+      return true;
+    }
     default:
-      return cmd_result(Status::COMMAND_NOT_SUPPORTED);
+      return false;
   }
 }
 
+// All commands, with consecutive opcodes. Argument and reply lengths
+// are checked by dispatchCommand before calling the handler, so
+// handlers only need to check argument values.
+static constexpr Command commands[] PROGMEM = {
+  // opcode                                minLen maxLen replyLen handler
+  {Commands::GET_LAST_MEASUREMENT,         0,     0,     4,       get_last_measurement},
+  {Commands::SET_HOPPER_TIMING,            6,     6,     0,       set_hopper_timing},
+  {Commands::GET_HOPPER_TIMING,            0,     0,     6,       get_hopper_timing},
+  {Commands::GET_LAST_MEASUREMENT_HIRES,   0,     0,     5,       get_last_measurement_hires},
+  {Commands::SET_OVERSAMPLING,             1,     1,     0,       set_oversampling},
+  {Commands::READ_HISTORY,                 2,     2,     3,       read_history},
+  {Commands::GET_ENCODER,                  0,     0,     4,       get_encoder},
+  {Commands::GET_INPUT_EVENTS,             0,     0,     1,       get_input_events},
+  {Commands::SET_ATTENTION_MASK,           1,     1,     0,       set_attention_mask},
+  {Commands::GET_ATTENTION,                0,     0,     2,       get_attention},
+  {Commands::STREAM_HISTORY,               0,     0,     2,       stream_history},
+  {Commands::PROFILE_DUMP,                 1,     1,     1,       profile_dump_cmd},
+  {Commands::PROFILE_CLEAR,                0,     0,     0,       profile_clear_cmd},
+  {Commands::GET_TASK_OVERRUNS,            0,     0,     1 + 2 * sizeof(tasks) / sizeof(*tasks), get_task_overruns},
+};
+
+static_assert(commandsValid(commands), "Command opcodes must be consecutive");
+static_assert(2 + maxReplyLen(commands) <= TWI_BUFFER_SIZE, "TWI_BUFFER_SIZE too small for the commands");
+
+CommandTable commandTable() {
+  return {commands, sizeof(commands) / sizeof(*commands)};
+}
+
+cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
+  return dispatchCommand<commands[0].opcode>(commands, cmd, datain, len, dataout, maxLen);
+}
+
 void start_display()
 {
   // This pin has a pullup to 3v3, so the display comes out of
@@ -78,32 +355,6 @@ void start_display()
   #endif
 }
 
-void measure_hopper()
-{
-#ifndef ENABLE_SERIAL // Serial reuses the H_sens pin
-  digitalWrite(H_Led, LED_ON);
-  delay(10);
-  uint16_t on = analogRead(H_Sens_ADC_Channel);
-
-  digitalWrite(H_Led, LED_OFF);
-  delay(10);
-  uint16_t off = analogRead(H_Sens_ADC_Channel);
-
-  // Store the raw measurements to be read through I²C
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    measurement[0] = on;
-    measurement[1] = off;
-  }
-
-  // Lower reading means more light
-  if (on < off && (off - on) > hopper_threshold)
-    digitalWrite(H_Out, HOPPER_EMPTY);
-  else
-    digitalWrite(H_Out, HOPPER_FULL);
-#endif
-}
-
-
 void setup()
 {
   #ifdef ENABLE_SERIAL
@@ -112,17 +363,26 @@ void setup()
   #endif
 
   pinMode(H_Led, OUTPUT);
-  pinMode(H_Out, OUTPUT);
+  attention_init();
   #ifndef ENABLE_SERIAL // Serial reuses the H_sens pin
   pinMode(H_Sens, INPUT);
   #endif
 
+  #ifdef ENABLE_PROFILING
+  profile_init();
+  #endif
+  initProtocol();
   TwoWireInit(/* useInterrupts */ true, I2C_ADDRESS);
 
   start_display();
+
+  hopper_init();
+  encoder_init();
+  button_init();
+  scheduler_init(taskStates);
 }
 
 void loop()
 {
-  measure_hopper();
+  scheduler_run(tasks, taskStates);
 }
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Profile.h"
+
+#ifdef ENABLE_PROFILING
+
+#include <util/atomic.h>
+
+struct ProfileStats {
+	uint16_t min;
+	uint16_t max;
+	uint32_t total;
+	uint16_t count;
+};
+
+static ProfileStats stats[ProfileTasks::COUNT];
+
+void profile_clear()
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		for (ProfileStats& s : stats) {
+			s = ProfileStats();
+			s.min = 0xffff;
+		}
+	}
+}
+
+void profile_init()
+{
+	profile_clear();
+	// Free running, no prescaler
+	TCCR1A = 0;
+	TCCR1B = _BV(CS10);
+}
+
+void profile_record(uint8_t task, uint16_t cycles)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ProfileStats& s = stats[task];
+		if (cycles < s.min)
+			s.min = cycles;
+		if (cycles > s.max)
+			s.max = cycles;
+		// Stop accumulating when count saturates, which also
+		// keeps total from overflowing.
+		if (s.count != 0xffff) {
+			s.total += cycles;
+			++s.count;
+		}
+	}
+}
+
+uint8_t profile_dump(uint8_t first, uint8_t *dataout, uint8_t maxLen)
+{
+	uint8_t len = 0;
+	dataout[len++] = ProfileTasks::COUNT;
+	for (uint8_t i = first; i < ProfileTasks::COUNT && len + PROFILE_ENTRY_SIZE <= maxLen; ++i) {
+		ProfileStats s;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			s = stats[i];
+		}
+		dataout[len++] = s.min >> 8;
+		dataout[len++] = s.min;
+		dataout[len++] = s.max >> 8;
+		dataout[len++] = s.max;
+		dataout[len++] = s.total >> 24;
+		dataout[len++] = s.total >> 16;
+		dataout[len++] = s.total >> 8;
+		dataout[len++] = s.total;
+		dataout[len++] = s.count >> 8;
+		dataout[len++] = s.count;
+	}
+	return len;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+// When defined, the tasks below record how many CPU cycles they take,
+// which can be read using the PROFILE_DUMP command. This uses Timer1,
+// running at the CPU clock, so durations of 65536 cycles (8ms at 8MHz)
+// or more wrap around. Durations include any interrupts that ran in
+// between. Timer1 stops during the ADC noise reduction sleep used by
+// Hopper (see HOPPER_ADC_NOISE_REDUCTION), so HOPPER_UPDATE is
+// under-reported when that is enabled.
+//#define ENABLE_PROFILING
+
+struct ProfileTasks {
+	enum {
+		// TWI_SLAVE_vect
+		TWI_ISR,
+		// Processing a request with a valid CRC (from the ISR or
+		// from TwoWirePoll())
+		PROCESS_REQUEST,
+		// Main loop tasks
+		TWI_POLL,
+		HOPPER_UPDATE,
+		BUTTON_UPDATE,
+
+		COUNT
+	};
+};
+
+// Size of a task as returned by profile_dump(): minimum, maximum,
+// total (32-bit) and count of its durations, all big endian.
+#define PROFILE_ENTRY_SIZE 10
+
+#ifdef ENABLE_PROFILING
+
+// Reads Timer1. The 16-bit read goes through the TEMP register, which
+// is shared with Timer2, so an interrupt that accesses either timer
+// between the two byte reads would corrupt the result.
+static inline uint16_t profile_now() {
+	uint16_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now = TCNT1;
+	}
+	return now;
+}
+
+#define PROFILE_BEGIN(task) uint16_t _profile_start_ ## task = profile_now()
+#define PROFILE_END(task) profile_record(ProfileTasks::task, profile_now() - _profile_start_ ## task)
+
+void profile_init();
+void profile_record(uint8_t task, uint16_t cycles);
+
+// Writes the number of tasks, followed by as many tasks as fit in
+// maxLen starting at first, into dataout and returns the length.
+uint8_t profile_dump(uint8_t first, uint8_t *dataout, uint8_t maxLen);
+void profile_clear();
+
+#else
+
+#define PROFILE_BEGIN(task)
+#define PROFILE_END(task)
+
+#endif
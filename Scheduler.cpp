@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Arduino.h"
+#include "Scheduler.h"
+#include "Profile.h"
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+static volatile bool wakePending;
+
+void scheduler_wake()
+{
+	wakePending = true;
+}
+
+void scheduler_init(TaskState *states, uint8_t count)
+{
+	uint16_t now = millis();
+	for (uint8_t i = 0; i < count; ++i) {
+		states[i].deadline = now;
+		states[i].overruns = 0;
+	}
+}
+
+void scheduler_run(const Task *tasks, TaskState *states, uint8_t count)
+{
+	wakePending = false;
+
+	for (uint8_t i = 0; i < count; ++i) {
+		const Task *t = &tasks[i];
+		TaskState& s = states[i];
+		uint16_t period = pgm_read_word(&t->period_ms);
+		uint16_t now = millis();
+
+		if (period) {
+			int16_t late = now - s.deadline;
+			if (late < 0)
+				continue;
+
+			if ((uint16_t)late >= period) {
+				// Missed one or more runs, skip them
+				if (s.overruns != 0xffff)
+					++s.overruns;
+				s.deadline = now + period;
+			} else {
+				s.deadline += period;
+			}
+		}
+
+		task_func run = (task_func)pgm_read_ptr(&t->run);
+		#ifdef ENABLE_PROFILING
+		uint16_t start = profile_now();
+		run();
+		profile_record(pgm_read_byte(&t->profileTask), profile_now() - start);
+		#else
+		run();
+		#endif
+	}
+
+	// Sleep until the next interrupt, unless something happened
+	// while running the tasks. Interrupts are enabled right before
+	// sleeping (sei takes effect after the next instruction), so an
+	// interrupt cannot slip in between the check and the sleep.
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	if (!wakePending) {
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+}
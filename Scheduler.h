@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <avr/pgmspace.h>
+
+typedef void (*task_func)();
+
+struct Task {
+	task_func run;
+	// Time between runs. Tasks with period 0 run after every wakeup,
+	// for tasks that are driven by interrupts.
+	uint16_t period_ms;
+	// ProfileTasks entry to record the duration in
+	uint8_t profileTask;
+};
+
+struct TaskState {
+	// millis() at which the task should run next
+	uint16_t deadline;
+	// Number of times the task ran a full period or more after its
+	// deadline, saturates at 0xffff.
+	uint16_t overruns;
+};
+
+// Makes all tasks due now, should be called at the end of setup()
+void scheduler_init(TaskState *states, uint8_t count);
+
+template <size_t N>
+inline void scheduler_init(TaskState (&states)[N]) {
+	scheduler_init(states, N);
+}
+
+// Runs the tasks from the given table (in PROGMEM) that are due, in
+// table order, and then sleeps in idle mode until the next interrupt.
+// Should be called from loop(). Timer0 (millis()) interrupts wake up
+// the CPU at least every couple of ms, which bounds the latency of
+// periodic tasks.
+void scheduler_run(const Task *tasks, TaskState *states, uint8_t count);
+
+template <size_t N>
+inline void scheduler_run(const Task (&tasks)[N], TaskState (&states)[N]) {
+	scheduler_run(tasks, states, N);
+}
+
+// Makes the next scheduler_run() skip the sleep, so all tasks with
+// period 0 run again right away. Must be called by interrupts that
+// make work for such tasks (since the interrupt can fire after the
+// task ran, but before the CPU goes to sleep), and by tasks that need
+// to run again. Can be called from interrupts.
+void scheduler_wake();
@@ -20,13 +20,99 @@
 
 #include <inttypes.h>
 
+// When defined, TwoWireCallback is not called from the interrupt
+// handler, but from TwoWirePoll(), which must then be called regularly
+// from the main loop. While a received frame is waiting to be
+// processed, the bus is held using clock stretching whenever the master
+// starts a new transfer. This keeps the time spent in the interrupt
+// handler short and independent of the command being processed.
+//#define TWI_DEFER_CALLBACK
+
+// Size of the request and reply buffers. This limits the request size
+// including its command and CRC bytes, and the reply size including
+// the status and length bytes used by BaseProtocol (the reply CRC is
+// generated while sending and not stored in the buffer). The driver
+// uses one of each and the BaseProtocol reply cache about one more, so
+// this costs three times as much RAM. Can be overridden from the build,
+// e.g. larger for bulk history reads (up to about 60 on the ATtiny841).
+#ifndef TWI_BUFFER_SIZE
+#define TWI_BUFFER_SIZE 32
+#endif
+
+// RAM that must remain for everything else after the TWI buffers and
+// the reply cache are allocated: about 220 bytes of other globals
+// (history ~100, hopper, button queue, encoder, scheduler, statistics)
+// and about 100 bytes of stack for the TWI interrupt on top of a
+// command handler. Checked in BaseProtocol.cpp.
+#ifndef TWI_RAM_RESERVE
+#define TWI_RAM_RESERVE 320
+#endif
+
+// A transfer that makes no progress for this long is aborted, to
+// recover from a glitch that made the driver miss a STOP condition.
+#ifndef TWI_TIMEOUT_MS
+#define TWI_TIMEOUT_MS 25
+#endif
+
 void TwoWireUpdate();
+// Should be called regularly from the main loop, to detect timeouts
+// and (with TWI_DEFER_CALLBACK) to process requests.
+void TwoWirePoll();
 void TwoWireInit(bool useInterrupts, uint8_t initialAddress, uint8_t initialMask = 0x00);
 void TwoWireDeinit();
 void TwoWireSetDeviceAddress(uint8_t address);
 uint8_t TwoWireGetDeviceAddress();
 void TwoWireResetDeviceAddress();
 
-int TwoWireCallback(uint8_t address, uint8_t *buffer, uint8_t len, uint8_t maxLen);
+// Number of errors the driver recovered from or that the master caused,
+// these saturate at 0xffff.
+struct TwoWireErrors {
+	// Illegal START or STOP conditions (TWBE)
+	uint16_t busErrors;
+	// Data collisions while sending (TWC)
+	uint16_t collisions;
+	// Transfers aborted after TWI_TIMEOUT_MS without progress
+	uint16_t timeouts;
+	// Bytes dropped because a request did not fit in the buffer
+	uint16_t overflows;
+	// Reads NACKed because no reply was available
+	uint16_t nackedReads;
+};
+
+TwoWireErrors TwoWireGetErrors();
+void TwoWireClearErrors();
+
+// Initial value of the CRC-8 (CCITT polynomial) computed over requests
+// and replies.
+#define TWI_CRC_INIT 0xff
+
+// Called with a received request in buffer, should replace it with the
+// reply and return the reply length (or 0 for no reply). crc is the
+// CRC over the received bytes, computed while they were received (so
+// it is 0 when the request ends with a valid CRC). When the reply is
+// read, its CRC is computed while sending and sent after the last
+// byte, so it does not need to be included in the buffer.
+//
+// Requests and replies use separate buffers, so the master can send its
+// next request before it has read the previous reply. That request is
+// processed right away, but its reply only becomes readable after the
+// previous reply was read. Until then, further writes are NACKed.
+int TwoWireCallback(uint8_t address, uint8_t *buffer, uint8_t len, uint8_t maxLen, uint8_t crc);
+
+// Produces byte pos of a stream into *data, or returns false when the
+// stream has ended. Called from the interrupt handler, so must be
+// quick.
+typedef bool (*TwoWireStreamProducer)(uint16_t pos, uint8_t *data);
+
+// Can be called from TwoWireCallback to attach a stream to the reply
+// being prepared. When the master keeps reading after the reply CRC,
+// the stream bytes are generated on demand by the producer, followed by
+// a CRC over the stream bytes once the producer returns false. This
+// allows sending more data than fits in the buffer, without preparing
+// it up front. The stream is generated again each time the reply is
+// read, so it reflects the data at the time of reading.
+void TwoWireSetStreamProducer(TwoWireStreamProducer producer);
+// Returns the producer set for the reply being prepared
+TwoWireStreamProducer TwoWireGetStreamProducer();
 
 #endif /* TWOWIRE_H_ */
@@ -18,11 +18,17 @@
 #if defined(__AVR_ATtiny841__) || defined(__AVR_ATtiny441__)
 
 #include "TwoWire.h"
+#include "Arduino.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "Crc8.h"
+#include "Profile.h"
+#include "Scheduler.h"
 
 static uint8_t initAddress = 0;
 static uint8_t initMask = 0;
+static bool initUseInterrupts = false;
 
 #if !defined(__AVR_ATtiny841__)
 #error "Only works with ATtiny841"
@@ -31,6 +37,7 @@ static uint8_t initMask = 0;
 void TwoWireInit(bool useInterrupts, uint8_t initialAddress, uint8_t initialMask) {
 	initAddress = initialAddress;
 	initMask = initialMask;
+	initUseInterrupts = useInterrupts;
 
 	TwoWireResetDeviceAddress();
 	TWSCRB = _BV(TWHNM);
@@ -70,12 +77,32 @@ static void _Acknowledge(bool ack, bool complete=false) {
 	TWSCRB |= _BV(TWCMD1) | (complete ? 0 : _BV(TWCMD0));
 }
 
+// Requests are received into twiRxBuffer, while reads are served from
+// twiTxBuffer. When a request has been processed, the buffers are
+// swapped (by pointer), but only once the master has started reading
+// the previous reply. This allows the master to send its next request
+// before reading the previous reply.
+static_assert(TWI_BUFFER_SIZE <= 255, "Lengths are 8-bit, so TWI_BUFFER_SIZE must fit");
 
-#define TWI_BUFFER_SIZE 32
-static uint8_t twiBuffer[TWI_BUFFER_SIZE];
-static uint8_t twiBufferLen = 0;
+static uint8_t twiBuffers[2][TWI_BUFFER_SIZE];
+static uint8_t *twiRxBuffer = twiBuffers[0];
+static uint8_t *twiTxBuffer = twiBuffers[1];
+static uint8_t twiRxLen = 0;
+static uint8_t twiTxLen = 0;
 static uint8_t twiReadPos = 0;
-static uint8_t twiAddress = 0;
+static uint8_t twiRxAddress = 0;
+// CRCs are updated as each byte is received or sent, so no time is
+// spent on them after the transfer completes.
+static uint8_t twiRxCrc = 0;
+static uint8_t twiTxCrc = 0;
+// Set when twiTxBuffer contains a reply the master did not start
+// reading yet.
+static bool twiTxUnread = false;
+// Stream producers for the reply in twiRxBuffer and twiTxBuffer
+static TwoWireStreamProducer twiRxProducer = nullptr;
+static TwoWireStreamProducer twiTxProducer = nullptr;
+static uint16_t twiStreamPos = 0;
+static bool twiStreamDone = false;
 
 enum TWIState {
 	TWIStateIdle,
@@ -85,7 +112,58 @@ enum TWIState {
 
 static TWIState twiState = TWIStateIdle;
 
+enum TWIRxState {
+	// twiRxBuffer is free to receive a request
+	TWIRxIdle,
+	// twiRxBuffer contains a request, TwoWireCallback was not
+	// called for it yet
+	TWIRxPending,
+	// twiRxBuffer contains a reply, waiting to be swapped into
+	// twiTxBuffer
+	TWIRxDone,
+};
+
+static volatile TWIRxState twiRxState = TWIRxIdle;
 
+static TwoWireErrors twiErrors;
+// Incremented by every interrupt, to detect stalled transfers
+static volatile uint8_t twiActivity = 0;
+
+static inline void _CountError(uint16_t *counter) {
+	if (*counter != 0xffff)
+		++*counter;
+}
+
+// Aborts the current transfer. A partially received request is
+// dropped, while a complete request or reply is kept.
+static void _AbortTransfer() {
+	if (twiState == TWIStateWrite)
+		twiRxLen = 0;
+	twiState = TWIStateIdle;
+}
+
+static void _SwapBuffersIfPossible() {
+	if (twiRxState != TWIRxDone || twiTxUnread || twiState == TWIStateRead)
+		return;
+
+	uint8_t *tmp = twiTxBuffer;
+	twiTxBuffer = twiRxBuffer;
+	twiTxLen = twiRxLen;
+	twiTxProducer = twiRxProducer;
+	twiTxUnread = (twiTxLen != 0);
+	twiRxBuffer = tmp;
+	twiRxLen = 0;
+	twiRxProducer = nullptr;
+	twiRxState = TWIRxIdle;
+}
+
+void TwoWireSetStreamProducer(TwoWireStreamProducer producer) {
+	twiRxProducer = producer;
+}
+
+TwoWireStreamProducer TwoWireGetStreamProducer() {
+	return twiRxProducer;
+}
 
 void TwoWireUpdate() {
 	uint8_t status = TWSSRA;
@@ -94,44 +172,123 @@ void TwoWireUpdate() {
 	bool isReadOperation = (status & _BV(TWDIR));
 	bool addressReceived = (status & _BV(TWAS)); // Check if we received an address and not a stop
 
-	// Clear the interrupt flags
-	// TWSSRA |= _BV(TWDIF) | _BV(TWASIF);
+	++twiActivity;
+
+	if (status & (_BV(TWBE) | _BV(TWC))) {
+		if (status & _BV(TWBE))
+			_CountError(&twiErrors.busErrors);
+		if (status & _BV(TWC))
+			_CountError(&twiErrors.collisions);
 
-	//volatile bool clockHold = (TWSSRA & _BV(TWCH));
-	//volatile bool receiveAck = (TWSSRA & _BV(TWRA));
-	//volatile bool collision = (TWSSRA & _BV(TWC));
-	//volatile bool busError = (TWSSRA & _BV(TWBE));
+		// Clear the error flags (by writing ones) and release the
+		// bus until the next START.
+		TWSSRA = status & (_BV(TWBE) | _BV(TWC));
+		_AbortTransfer();
+		_SwapBuffersIfPossible();
+		_Acknowledge(false /*ack*/, true /*complete*/);
+		return;
+	}
 
 	// Handle address received and stop conditions
 	if (isAddressOrStop) {
 		// If we were previously in a write, then execute the callback and setup for a read.
-		if ((twiState == TWIStateWrite) and twiBufferLen != 0) {
-			twiBufferLen = TwoWireCallback(twiAddress, twiBuffer, twiBufferLen, TWI_BUFFER_SIZE);
+		if ((twiState == TWIStateWrite) and twiRxLen != 0) {
+			twiRxState = TWIRxPending;
+#ifdef TWI_DEFER_CALLBACK
+			scheduler_wake();
+#else
+			twiRxProducer = nullptr;
+			twiRxLen = TwoWireCallback(twiRxAddress, twiRxBuffer, twiRxLen, TWI_BUFFER_SIZE, twiRxCrc);
+			twiRxState = TWIRxDone;
+#endif
 		}
 
-		// Send an ack unless a read is starting and there are no bytes to read.
-		bool ack = (twiBufferLen > 0) or (!isReadOperation) or (!addressReceived);
-		_Acknowledge(ack, !addressReceived /*complete*/);
+		// Any read or write ends here
+		twiState = TWIStateIdle;
+		_SwapBuffersIfPossible();
 
 		if (!addressReceived) {
-			twiState = TWIStateIdle;
-		} else if (isReadOperation) {
+			_Acknowledge(true /*ack*/, true /*complete*/);
+			return;
+		}
+
+#ifdef TWI_DEFER_CALLBACK
+		if (twiRxState == TWIRxPending and (!isReadOperation or !twiTxUnread)) {
+			// A new transfer is starting, but it needs the
+			// pending request to be processed first. Leave the
+			// interrupt flag set, which keeps SCL low (clock
+			// stretching), and disable the interrupt until
+			// TwoWirePoll() has called the callback.
+			TWSCRA &= ~_BV(TWASIE);
+			return;
+		}
+#endif
+
+		if (isReadOperation) {
+			// Send an ack unless there are no bytes to read.
+			_Acknowledge(twiTxLen > 0, false /*complete*/);
+			if (twiTxLen == 0)
+				_CountError(&twiErrors.nackedReads);
 			twiState = TWIStateRead;
 			twiReadPos = 0;
+			twiTxCrc = TWI_CRC_INIT;
+			twiTxUnread = false;
+			twiStreamPos = 0;
+			twiStreamDone = false;
 		} else {
+			// The address is in the high 7 bits, the RD/WR bit is in the lsb
+			uint8_t address = TWSD >> 1;
+			if (address == 0) {
+				// General calls (resets) are always accepted,
+				// so a master that lost track of its replies
+				// can recover. Drop any replies it did not
+				// read, general calls have no reply.
+				twiRxState = TWIRxIdle;
+				twiRxProducer = nullptr;
+				twiTxUnread = false;
+				twiTxLen = 0;
+				twiTxProducer = nullptr;
+			} else if (twiRxState != TWIRxIdle) {
+				// The previous request was processed, but its
+				// reply is waiting for the reply before it to be
+				// read, so there is no room for another request.
+				_Acknowledge(false /*ack*/, false /*complete*/);
+				return;
+			}
+
+			_Acknowledge(true /*ack*/, false /*complete*/);
 			twiState = TWIStateWrite;
-			twiBufferLen = 0;
+			twiRxLen = 0;
+			twiRxCrc = TWI_CRC_INIT;
+			twiRxAddress = address;
 		}
-
-		// The address is in the high 7 bits, the RD/WR bit is in the lsb
-		twiAddress = TWSD >> 1;
 		return;
 	}
 
 	// Data Read
 	if (dataInterruptFlag and isReadOperation) {
-		if (twiReadPos < twiBufferLen) {
-			TWSD = twiBuffer[twiReadPos++];
+		if (twiReadPos < twiTxLen) {
+			uint8_t data = twiTxBuffer[twiReadPos++];
+			TWSD = data;
+			_Acknowledge(true /*ack*/, false /*complete*/);
+			twiTxCrc = crc8_update(twiTxCrc, data);
+		} else if (twiReadPos == twiTxLen) {
+			// Reply complete, append the CRC
+			TWSD = twiTxCrc;
+			_Acknowledge(true /*ack*/, false /*complete*/);
+			++twiReadPos;
+			twiTxCrc = TWI_CRC_INIT;
+		} else if (twiTxProducer && !twiStreamDone) {
+			uint8_t data;
+			if (twiTxProducer(twiStreamPos, &data)) {
+				++twiStreamPos;
+				twiTxCrc = crc8_update(twiTxCrc, data);
+			} else {
+				// Stream complete, append its CRC
+				data = twiTxCrc;
+				twiStreamDone = true;
+			}
+			TWSD = data;
 			_Acknowledge(true /*ack*/, false /*complete*/);
 		} else {
 			TWSD = 0;
@@ -145,17 +302,86 @@ void TwoWireUpdate() {
 		uint8_t data = TWSD;
 		_Acknowledge(true, false);
 
-		if (twiBufferLen < TWI_BUFFER_SIZE) {
-			twiBuffer[twiBufferLen++] = data;
+		if (twiRxLen < TWI_BUFFER_SIZE) {
+			twiRxBuffer[twiRxLen++] = data;
+			twiRxCrc = crc8_update(twiRxCrc, data);
+		} else {
+			_CountError(&twiErrors.overflows);
+		}
+		return;
+	}
+}
+
+TwoWireErrors TwoWireGetErrors() {
+	TwoWireErrors errors;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		errors = twiErrors;
+	}
+	return errors;
+}
+
+void TwoWireClearErrors() {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		twiErrors = TwoWireErrors();
+	}
+}
+
+static void _CheckTimeout() {
+	static uint8_t lastActivity;
+	static uint16_t lastActivityTime;
+	uint16_t now = millis();
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		// Only transfers in progress can time out. When the bus
+		// is held on purpose (TWI_DEFER_CALLBACK), the state is
+		// already idle.
+		if (twiState == TWIStateIdle || twiActivity != lastActivity) {
+			lastActivity = twiActivity;
+			lastActivityTime = now;
+		} else if ((uint16_t)(now - lastActivityTime) > TWI_TIMEOUT_MS) {
+			_CountError(&twiErrors.timeouts);
+			_AbortTransfer();
+			_SwapBuffersIfPossible();
+			// Reset the hardware, to release SCL in case the
+			// interface is still holding it.
+			TWSCRA &= ~_BV(TWEN);
+			TWSCRA |= _BV(TWEN);
+			lastActivityTime = now;
 		}
+	}
+}
+
+void TwoWirePoll() {
+	_CheckTimeout();
+
+#ifdef TWI_DEFER_CALLBACK
+	if (twiRxState != TWIRxPending)
 		return;
+
+	// The ISR does not touch the receive buffer while a request is
+	// pending, so this can run with interrupts enabled.
+	twiRxProducer = nullptr;
+	uint8_t len = TwoWireCallback(twiRxAddress, twiRxBuffer, twiRxLen, TWI_BUFFER_SIZE, twiRxCrc);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		twiRxLen = len;
+		twiRxState = TWIRxDone;
+		_SwapBuffersIfPossible();
+
+		// Release the bus, if it was held. If an address
+		// interrupt is still pending, it fires right away.
+		if (initUseInterrupts)
+			TWSCRA |= _BV(TWASIE);
 	}
+#endif
 }
 
 // The two wire interrupt service routine
 ISR(TWI_SLAVE_vect)
 {
+	PROFILE_BEGIN(TWI_ISR);
 	TwoWireUpdate();
+	PROFILE_END(TWI_ISR);
 }
 
 #endif
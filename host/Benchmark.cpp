@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Bus benchmark: acts as I²C master and runs each command many times,
+// checking the status and CRC of every reply. For each command it
+// measures, in host nanoseconds:
+//  - the number of TWI interrupts per transfer and their mean and
+//    maximum duration (the per-byte cost of the interrupt handler),
+//  - the time from the STOP ending a request until the reply can be
+//    read (the turnaround, including processing the request),
+//  - the longest stretch with interrupts disabled, in the interrupt
+//    handler or an atomic block.
+// Each figure is taken per transfer, and the median over all transfers
+// is printed, so occasional preemption by the OS does not show. Host
+// time is no AVR cycle count, but it grows with the work done (CRC,
+// dispatch, handlers), so it can be compared before and after a
+// change. The last column is the number of register accesses per
+// transfer, which does not depend on the PC but only counts I/O. The
+// results are printed as CSV, one line per command.
+//
+// Every command in the protocol and application command tables is run
+// with all-zero arguments of its minimum length, followed by a few
+// requests that exercise the framing and the error paths.
+//
+// Usage: benchmark [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "Shim.h"
+#include "Crc8.h"
+#include "TwoWire.h"
+#include "BaseProtocol.h"
+#include "Hardware.h"
+
+struct BenchCommand {
+	char name[24];
+	uint8_t request[8];
+	uint8_t len;
+	bool corruptCrc;
+	uint8_t status;
+};
+
+static const BenchCommand extraCommands[] = {
+	{"BATCH", {0x70, 0x80, 0, 0x86, 0, 0x89, 0}, 7, false, Status::COMMAND_OK},
+	// Only runs the command the first time, then replays
+	{"SEQUENCED", {0x74, 0, 0x80}, 3, false, Status::COMMAND_OK},
+	{"invalid_arguments", {0x80, 0}, 2, false, Status::INVALID_ARGUMENTS},
+	{"not_supported", {0x7f}, 1, false, Status::COMMAND_NOT_SUPPORTED},
+	{"invalid_crc", {0x80}, 1, true, Status::INVALID_CRC},
+};
+
+// Adds each compiled-in command in table, except BATCH and SEQUENCED,
+// which need a wrapped request (see extraCommands).
+static void addCommands(std::vector<BenchCommand>& commands, CommandTable table) {
+	for (uint8_t i = 0; i < table.count; ++i) {
+		const Command *c = &table.commands[i];
+		uint8_t opcode = pgm_read_byte(&c->opcode);
+		uint8_t minLen = pgm_read_byte(&c->minLen);
+		if (!pgm_read_ptr(&c->handler) || opcode == ProtocolCommands::BATCH || opcode == ProtocolCommands::SEQUENCED)
+			continue;
+
+		BenchCommand cmd = BenchCommand();
+		if (minLen >= sizeof(cmd.request)) {
+			fprintf(stderr, "0x%02x: arguments too long\n", opcode);
+			exit(1);
+		}
+		snprintf(cmd.name, sizeof(cmd.name), "0x%02x", opcode);
+		cmd.request[0] = opcode;
+		cmd.len = 1 + minLen;
+		cmd.status = Status::COMMAND_OK;
+		commands.push_back(cmd);
+	}
+}
+
+static void pollDeferred() {
+	TwoWirePoll();
+}
+
+// Costs within the current transfer
+static struct {
+	unsigned isrCalls;
+	uint64_t isrNs;
+	uint64_t isrMaxNs;
+	uint64_t irqOffMaxNs;
+	uint64_t accesses;
+} current;
+
+// Overhead of measuring, subtracted from every measurement
+static uint64_t overheadNs;
+
+static uint64_t withoutOverhead(uint64_t ns) {
+	return ns > overheadNs ? ns - overheadNs : 0;
+}
+
+static void isrProbe(const HostCost& cost) {
+	uint64_t ns = withoutOverhead(cost.ns);
+	++current.isrCalls;
+	current.isrNs += ns;
+	current.isrMaxNs = std::max(current.isrMaxNs, ns);
+	current.irqOffMaxNs = std::max(current.irqOffMaxNs, ns);
+	current.accesses += cost.accesses;
+}
+
+static void atomicProbe(const HostCost& cost) {
+	current.irqOffMaxNs = std::max(current.irqOffMaxNs, withoutOverhead(cost.ns));
+}
+
+static uint64_t median(std::vector<uint64_t>& values) {
+	std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+	return values[values.size() / 2];
+}
+
+static void calibrate() {
+	std::vector<uint64_t> samples;
+	for (unsigned i = 0; i < 10000; ++i)
+		samples.push_back(host_cost_since(host_cost_now()).ns);
+	overheadNs = median(samples);
+}
+
+// Sends one request and reads back the reply, exiting when it does not
+// have the expected status or a valid CRC. Returns the time from the
+// STOP after the request until the reply read was acknowledged.
+static uint64_t transfer(const BenchCommand& cmd) {
+	uint8_t crc = TWI_CRC_INIT;
+	host_twi_start(I2C_ADDRESS, false);
+	for (uint8_t i = 0; i < cmd.len; ++i) {
+		host_twi_write(cmd.request[i]);
+		crc = crc8_update(crc, cmd.request[i]);
+	}
+	host_twi_write(cmd.corruptCrc ? ~crc : crc);
+
+	HostCost start = host_cost_now();
+	host_twi_stop();
+	bool ack = host_twi_start(I2C_ADDRESS, true);
+	uint64_t ready = withoutOverhead(host_cost_since(start).ns);
+
+	if (!ack) {
+		fprintf(stderr, "%s: reply not acknowledged\n", cmd.name);
+		exit(1);
+	}
+
+	// Status and length, then the payload and CRC. The CRC over
+	// all of these is zero for a valid reply.
+	crc = TWI_CRC_INIT;
+	uint8_t status = host_twi_read(true);
+	crc = crc8_update(crc, status);
+	uint8_t len = host_twi_read(true);
+	crc = crc8_update(crc, len);
+	for (uint8_t i = 0; i < len; ++i)
+		crc = crc8_update(crc, host_twi_read(true));
+	crc = crc8_update(crc, host_twi_read(false));
+	host_twi_stop();
+
+	if (status != cmd.status || crc != 0) {
+		fprintf(stderr, "%s: status 0x%02x (expected 0x%02x), %s CRC\n",
+		        cmd.name, status, cmd.status, crc ? "invalid" : "valid");
+		exit(1);
+	}
+	return ready;
+}
+
+int main(int argc, char **argv) {
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+
+	setup();
+	// Make sure a measurement is available
+	for (uint8_t i = 0; i < 100; ++i) {
+		loop();
+		host_advance(1000);
+	}
+	host_twi_stretch = pollDeferred;
+
+	std::vector<BenchCommand> commands;
+	addCommands(commands, protocolCommandTable());
+	addCommands(commands, commandTable());
+	commands.insert(commands.end(), extraCommands, extraCommands + sizeof(extraCommands) / sizeof(*extraCommands));
+
+	calibrate();
+	host_twi_isr_probe = isrProbe;
+	host_atomic_probe = atomicProbe;
+
+	printf("command,isr_calls,isr_ns_mean,isr_ns_max,stop_to_ready_ns,irq_off_ns_max,register_accesses\n");
+	for (const BenchCommand& cmd : commands) {
+		std::vector<uint64_t> isrMean, isrMax, ready, irqOff, accesses;
+		unsigned isrCalls = 0;
+
+		for (unsigned long i = 0; i < iterations; ++i) {
+			current = {};
+			ready.push_back(transfer(cmd));
+			isrCalls = current.isrCalls;
+			isrMean.push_back(current.isrNs / current.isrCalls);
+			isrMax.push_back(current.isrMaxNs);
+			irqOff.push_back(current.irqOffMaxNs);
+			accesses.push_back(current.accesses);
+		}
+
+		printf("%s,%u,%llu,%llu,%llu,%llu,%llu\n", cmd.name, isrCalls,
+		       (unsigned long long)median(isrMean),
+		       (unsigned long long)median(isrMax),
+		       (unsigned long long)median(ready),
+		       (unsigned long long)median(irqOff),
+		       (unsigned long long)median(accesses));
+	}
+	return 0;
+}
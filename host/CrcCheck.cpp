@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks that all CRC-8 implementations in Crc8.h give the same result
+// for every combination of CRC and data byte.
+
+#include <stdio.h>
+#include "Crc8.h"
+
+int main() {
+	unsigned errors = 0;
+	for (unsigned crc = 0; crc < 256; ++crc) {
+		for (unsigned data = 0; data < 256; ++data) {
+			uint8_t expected = crc8_update_bitwise(crc, data);
+			uint8_t nibble = crc8_update_nibble(crc, data);
+			uint8_t table = crc8_update_table(crc, data);
+			if (nibble != expected || table != expected) {
+				if (++errors <= 10)
+					fprintf(stderr, "crc 0x%02x, data 0x%02x: bitwise 0x%02x, nibble 0x%02x, table 0x%02x\n",
+					        crc, data, expected, nibble, table);
+			}
+		}
+	}
+
+	if (errors) {
+		fprintf(stderr, "CRC-8 implementations differ for %u inputs\n", errors);
+		return 1;
+	}
+	printf("CRC-8 implementations agree\n");
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs the firmware on the host: setup() once, then the given number
+// of loop() iterations (default 10000) in simulated time. Each
+// iteration is assumed to take 100μs, in addition to any delays or
+// sleeps.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "Shim.h"
+
+int main(int argc, char **argv) {
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000;
+
+	setup();
+	for (unsigned long i = 0; i < iterations; ++i) {
+		try {
+			loop();
+			host_advance(100);
+		} catch (HostReset&) {
+			setup();
+		}
+	}
+
+	printf("%lu iterations, %lu ms simulated\n", iterations, millis());
+	return 0;
+}
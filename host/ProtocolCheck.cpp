@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the protocol end to end: acts as I²C master, sends requests
+// to the firmware and decodes the replies, exiting with an error on the
+// first reply that is not as expected.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Shim.h"
+#include "Crc8.h"
+#include "TwoWire.h"
+#include "BaseProtocol.h"
+#include "Hardware.h"
+#include "History.h"
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+struct Reply {
+	uint8_t status;
+	uint8_t len;
+	uint8_t data[TWI_BUFFER_SIZE];
+};
+
+// Sends a request (the CRC is added) and reads back the reply, checking
+// its CRC. When stream is given, also reads streamLen bytes of the
+// stream attached to the reply and checks the stream CRC.
+static Reply transfer(const uint8_t *request, uint8_t len, uint8_t *stream = nullptr, uint16_t streamLen = 0) {
+	uint8_t crc = TWI_CRC_INIT;
+	CHECK(host_twi_start(I2C_ADDRESS, false));
+	for (uint8_t i = 0; i < len; ++i) {
+		CHECK(host_twi_write(request[i]));
+		crc = crc8_update(crc, request[i]);
+	}
+	CHECK(host_twi_write(crc));
+	host_twi_stop();
+
+	Reply reply;
+	CHECK(host_twi_start(I2C_ADDRESS, true));
+	crc = TWI_CRC_INIT;
+	reply.status = host_twi_read(true);
+	crc = crc8_update(crc, reply.status);
+	reply.len = host_twi_read(true);
+	crc = crc8_update(crc, reply.len);
+	CHECK(reply.len <= sizeof(reply.data));
+	for (uint8_t i = 0; i < reply.len; ++i) {
+		reply.data[i] = host_twi_read(true);
+		crc = crc8_update(crc, reply.data[i]);
+	}
+	crc = crc8_update(crc, host_twi_read(stream != nullptr));
+	CHECK(crc == 0);
+
+	if (stream) {
+		crc = TWI_CRC_INIT;
+		for (uint16_t i = 0; i < streamLen; ++i) {
+			stream[i] = host_twi_read(true);
+			crc = crc8_update(crc, stream[i]);
+		}
+		crc = crc8_update(crc, host_twi_read(false));
+		CHECK(crc == 0);
+	}
+	host_twi_stop();
+	return reply;
+}
+
+template <size_t N>
+static Reply transfer(const uint8_t (&request)[N], uint8_t *stream = nullptr, uint16_t streamLen = 0) {
+	return transfer(request, N, stream, streamLen);
+}
+
+// Checks that a BATCH runs every sub-command, also after one that is
+// not supported or has invalid arguments, and that each sub-reply has
+// the right status and length.
+static void checkBatch() {
+	const uint8_t request[] = {
+		ProtocolCommands::BATCH,
+		0x80, 0, // GET_LAST_MEASUREMENT
+		0x7f, 0, // Not supported
+		0x84, 0, // SET_OVERSAMPLING, missing its argument
+		0x82, 0, // GET_HOPPER_TIMING
+	};
+	const struct {
+		uint8_t status;
+		uint8_t len;
+	} expected[] = {
+		{Status::COMMAND_OK, 4},
+		{Status::COMMAND_NOT_SUPPORTED, 0},
+		{Status::INVALID_ARGUMENTS, 0},
+		{Status::COMMAND_OK, 6},
+	};
+
+	Reply reply = transfer(request);
+	CHECK(reply.status == Status::COMMAND_OK);
+
+	uint8_t pos = 0;
+	for (const auto& e : expected) {
+		CHECK(reply.len - pos >= 2);
+		CHECK(reply.data[pos] == e.status);
+		CHECK(reply.data[pos + 1] == e.len);
+		pos += 2 + reply.data[pos + 1];
+	}
+	CHECK(pos == reply.len);
+
+	// The last sub-reply should match the same command on its own
+	const uint8_t timing[] = {0x82};
+	Reply single = transfer(timing);
+	CHECK(single.status == Status::COMMAND_OK);
+	CHECK(single.len == 6);
+	CHECK(memcmp(single.data, reply.data + reply.len - 6, 6) == 0);
+}
+
+// Reads the HISTORY object in pages using READ_OBJECT and checks that
+// it matches the same data streamed by STREAM_HISTORY, which is longer
+// than fits in the TWI buffer.
+static void checkHistory() {
+	static_assert(HISTORY_RAW_SIZE > TWI_BUFFER_SIZE, "Stream should not fit in the buffer");
+
+	uint8_t object[HISTORY_RAW_SIZE];
+	uint16_t offset = 0;
+	do {
+		const uint8_t request[] = {ProtocolCommands::READ_OBJECT, 0x00 /* HISTORY */, (uint8_t)(offset >> 8), (uint8_t)offset};
+		Reply reply = transfer(request);
+		CHECK(reply.status == Status::COMMAND_OK);
+		CHECK(reply.len > 2);
+		uint16_t size = reply.data[0] << 8 | reply.data[1];
+		CHECK(size == HISTORY_RAW_SIZE);
+		uint8_t n = reply.len - 2;
+		CHECK(n <= size - offset);
+		memcpy(object + offset, reply.data + 2, n);
+		offset += n;
+	} while (offset < HISTORY_RAW_SIZE);
+
+	// Reading past the end returns the size, but no data
+	const uint8_t end[] = {ProtocolCommands::READ_OBJECT, 0x00, HISTORY_RAW_SIZE >> 8, HISTORY_RAW_SIZE & 0xff};
+	Reply reply = transfer(end);
+	CHECK(reply.status == Status::COMMAND_OK);
+	CHECK(reply.len == 2);
+
+	uint8_t stream[HISTORY_RAW_SIZE];
+	const uint8_t request[] = {0x8a}; // STREAM_HISTORY
+	reply = transfer(request, stream, sizeof(stream));
+	CHECK(reply.status == Status::COMMAND_OK);
+	CHECK(reply.len == 2);
+	CHECK((reply.data[0] << 8 | reply.data[1]) == HISTORY_RAW_SIZE);
+	CHECK(memcmp(object, stream, sizeof(stream)) == 0);
+
+	// Every slot should have been written, the sequence number of the
+	// newest sample is the one before the next.
+	uint16_t newest = history_get_next_seq() - 1;
+	bool found = false;
+	for (uint8_t i = 0; i < HISTORY_SIZE; ++i) {
+		const uint8_t *slot = object + i * HISTORY_RAW_ENTRY_SIZE;
+		uint16_t seq = slot[0] << 8 | slot[1];
+		CHECK(seq % HISTORY_SIZE == i);
+		found |= (seq == newest);
+	}
+	CHECK(found);
+}
+
+// Returns the unsupported command counter from GET_STATS
+static uint16_t unsupportedCount() {
+	const uint8_t request[] = {ProtocolCommands::GET_STATS};
+	Reply reply = transfer(request);
+	CHECK(reply.status == Status::COMMAND_OK);
+	CHECK(reply.len >= 8);
+	return reply.data[6] << 8 | reply.data[7];
+}
+
+// Checks that resending a SEQUENCED request returns the same reply
+// without running its commands again, and that a stream attached to
+// the reply is generated again from the current data.
+static void checkSequenced() {
+	// The unsupported sub-command has a side effect: it increments
+	// the unsupported counter.
+	const uint8_t request[] = {
+		ProtocolCommands::SEQUENCED, 1,
+		ProtocolCommands::BATCH,
+		0x7f, 0, // Not supported
+		0x80, 0, // GET_LAST_MEASUREMENT
+	};
+	uint16_t unsupported = unsupportedCount();
+	Reply first = transfer(request);
+	CHECK(first.status == Status::COMMAND_OK);
+	CHECK(unsupportedCount() == unsupported + 1);
+
+	Reply retry = transfer(request);
+	CHECK(retry.status == first.status);
+	CHECK(retry.len == first.len);
+	CHECK(memcmp(retry.data, first.data, first.len) == 0);
+	CHECK(unsupportedCount() == unsupported + 1);
+
+	// A new sequence number runs the request again
+	uint8_t next[sizeof(request)];
+	memcpy(next, request, sizeof(request));
+	next[1] = 2;
+	CHECK(transfer(next).status == Status::COMMAND_OK);
+	CHECK(unsupportedCount() == unsupported + 2);
+
+	// A retry of a streaming reply includes samples added since
+	const uint8_t stream[] = {ProtocolCommands::SEQUENCED, 3, 0x8a /* STREAM_HISTORY */};
+	uint8_t data[HISTORY_RAW_SIZE];
+	first = transfer(stream, data, sizeof(data));
+	CHECK(first.status == Status::COMMAND_OK);
+
+	history_add(0x1234, 0x5678);
+	uint16_t seq = history_get_next_seq() - 1;
+	retry = transfer(stream, data, sizeof(data));
+	CHECK(retry.status == first.status);
+	CHECK(retry.len == first.len);
+	CHECK(memcmp(retry.data, first.data, first.len) == 0);
+
+	const uint8_t *slot = data + (seq % HISTORY_SIZE) * HISTORY_RAW_ENTRY_SIZE;
+	CHECK((slot[0] << 8 | slot[1]) == seq);
+	CHECK((slot[2] << 8 | slot[3]) == 0x1234);
+	CHECK((slot[4] << 8 | slot[5]) == 0x5678);
+}
+
+static void pollDeferred() {
+	TwoWirePoll();
+}
+
+int main() {
+	setup();
+	// Fill the history, so all of it is checked
+	while (history_get_next_seq() < 2 * HISTORY_SIZE) {
+		loop();
+		host_advance(1000);
+	}
+	// Keep the firmware state unchanged during a transfer
+	host_twi_stretch = pollDeferred;
+
+	checkBatch();
+	checkHistory();
+	checkSequenced();
+
+	printf("Protocol checks passed\n");
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host replacement for the parts of the ATTinyCore Arduino API used by
+// the firmware. Pin numbering follows the ATtiny841 (clockwise) pinout.
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define PIN_B0 0
+#define PIN_B1 1
+#define PIN_B2 2
+#define PIN_A7 3
+#define PIN_A6 4
+#define PIN_A5 5
+#define PIN_A4 6
+#define PIN_A3 7
+#define PIN_A2 8
+#define PIN_A1 9
+#define PIN_A0 10
+#define PIN_B3 11
+
+#define NUM_DIGITAL_PINS 12
+
+#define analogInputToDigitalPin(p) (((p) < 8) ? 10 - (p) : -1)
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t channel);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void setup();
+void loop();
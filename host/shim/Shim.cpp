@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "Shim.h"
+#include <avr/wdt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+uint64_t host_register_accesses = 0;
+
+HostRegister<uint8_t> SREG;
+
+HostRegister<uint8_t> TWSCRA;
+HostRegister<uint8_t> TWSCRB;
+HostRegister<uint8_t> TWSSRA;
+HostRegister<uint8_t> TWSA;
+HostRegister<uint8_t> TWSAM;
+HostRegister<uint8_t> TWSD;
+
+HostRegister<uint8_t> TCCR1A;
+HostRegister<uint8_t> TCCR1B;
+
+HostRegister<uint8_t> TCCR2A;
+HostRegister<uint8_t> TCCR2B;
+HostRegister<uint16_t> TCNT2;
+HostRegister<uint16_t> OCR2A;
+HostRegister<uint8_t> TIMSK2;
+HostRegister<uint8_t> TIFR2;
+
+HostRegister<uint8_t> ADCSRA;
+HostRegister<uint8_t> ADMUXA;
+HostRegister<uint8_t> ADMUXB;
+HostRegister<uint16_t> ADC;
+
+HostRegister<uint8_t> PINA;
+HostRegister<uint8_t> PINB;
+HostRegister<uint8_t> GIMSK;
+HostRegister<uint8_t> PCMSK0;
+HostRegister<uint8_t> PCMSK1;
+
+// Like the AVR runtime, provide an empty handler for any interrupt
+// the firmware does not handle.
+#define DEFAULT_ISR(vector) extern "C" __attribute__((weak)) void vector(void) { }
+DEFAULT_ISR(TWI_SLAVE_vect)
+DEFAULT_ISR(TIMER2_COMPA_vect)
+DEFAULT_ISR(ADC_vect)
+DEFAULT_ISR(PCINT0_vect)
+DEFAULT_ISR(PCINT1_vect)
+
+uint64_t host_time_us = 0;
+uint32_t host_interrupts = 0;
+static uint8_t sleepMode;
+uint8_t host_pin_mode[NUM_DIGITAL_PINS];
+uint8_t host_pin_value[NUM_DIGITAL_PINS];
+
+static uint16_t defaultAdcSource(uint8_t /* channel */) {
+	return 512;
+}
+
+uint16_t (*host_adc_source)(uint8_t channel) = defaultAdcSource;
+
+static void defaultTwiStretch() {
+	loop();
+}
+
+void (*host_twi_stretch)() = defaultTwiStretch;
+
+// Prescaler for each clock select value, 0 means stopped (external
+// clock sources are not supported).
+static const uint16_t prescalers[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+// Runs a 16-bit timer in normal mode for the given number of CPU cycles,
+// firing the compare match A interrupt when enabled. The flag and
+// enable bits are in the same position for all timers.
+struct HostTimer {
+	HostRegister<uint8_t> &tccrb;
+	HostRegister<uint16_t> &tcnt;
+	HostRegister<uint16_t> &ocra;
+	HostRegister<uint8_t> &timsk;
+	HostRegister<uint8_t> &tifr;
+	void (*compa_vect)();
+	uint32_t cycles;
+
+	void run(uint32_t elapsed) {
+		uint16_t prescaler = prescalers[tccrb.value & 0x7];
+		if (!prescaler)
+			return;
+
+		cycles += elapsed;
+		while (cycles >= prescaler) {
+			cycles -= prescaler;
+			if (++tcnt.value == ocra.value) {
+				tifr.value |= _BV(OCF2A);
+				if (timsk.value & _BV(OCIE2A)) {
+					tifr.value &= ~_BV(OCF2A);
+					++host_interrupts;
+					compa_vect();
+				}
+			}
+		}
+	}
+};
+
+static HostTimer timer2 = {TCCR2B, TCNT2, OCR2A, TIMSK2, TIFR2, TIMER2_COMPA_vect, 0};
+
+// Runs a conversion whenever ADSC is set, taking 13 ADC clock cycles
+struct HostAdc {
+	uint32_t cycles;
+	bool running;
+
+	void run(uint32_t elapsed) {
+		if (!(ADCSRA.value & _BV(ADEN)) || !(ADCSRA.value & _BV(ADSC)))
+			return;
+
+		if (!running) {
+			uint8_t prescaler = 1 << (ADCSRA.value & 0x7);
+			cycles = 13 * (prescaler < 2 ? 2 : prescaler);
+			running = true;
+		}
+
+		if (cycles > elapsed) {
+			cycles -= elapsed;
+			return;
+		}
+
+		running = false;
+		ADC.value = host_adc_source(ADMUXA.value & 0x3f);
+		ADCSRA.value = (ADCSRA.value & ~_BV(ADSC)) | _BV(ADIF);
+		if (ADCSRA.value & _BV(ADIE)) {
+			ADCSRA.value &= ~_BV(ADIF);
+			++host_interrupts;
+			ADC_vect();
+		}
+	}
+};
+
+static HostAdc adc;
+
+// Timer0 overflows every 256 * 64 cycles, which the Arduino core uses
+// for millis(). Only its effect of waking up the CPU is modeled.
+struct HostTimer0 {
+	uint32_t cycles;
+
+	void run(uint32_t elapsed) {
+		cycles += elapsed;
+		while (cycles >= 256 * 64) {
+			cycles -= 256 * 64;
+			++host_interrupts;
+		}
+	}
+};
+
+static HostTimer0 timer0;
+
+void host_advance(uint32_t us) {
+	// Advance in small steps, so interrupts fire at about the
+	// right time relative to each other
+	while (us) {
+		uint32_t step = us > 10 ? 10 : us;
+		host_time_us += step;
+		us -= step;
+		timer2.run(step * (F_CPU / 1000000));
+		adc.run(step * (F_CPU / 1000000));
+		timer0.run(step * (F_CPU / 1000000));
+	}
+}
+
+void set_sleep_mode(uint8_t mode) {
+	sleepMode = mode;
+}
+
+void sleep_cpu() {
+	// Entering ADC noise reduction mode starts a conversion
+	if (sleepMode == SLEEP_MODE_ADC && (ADCSRA.value & _BV(ADEN)))
+		ADCSRA.value |= _BV(ADSC);
+
+	uint32_t interrupts = host_interrupts;
+	while (interrupts == host_interrupts)
+		host_advance(1);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+	host_pin_mode[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+	host_pin_value[pin] = val;
+}
+
+int digitalRead(uint8_t pin) {
+	return host_pin_value[pin];
+}
+
+int analogRead(uint8_t channel) {
+	return host_adc_source(channel);
+}
+
+void host_set_pin(uint8_t pin, uint8_t value) {
+	host_pin_value[pin] = value;
+
+	// Pins 0-2 and 11 are PB0-PB3, pins 3-10 are PA7-PA0
+	bool portB = (pin <= 2 || pin == 11);
+	uint8_t bit = _BV(pin == 11 ? 3 : portB ? pin : 10 - pin);
+	volatile uint8_t &reg = portB ? PINB.value : PINA.value;
+	uint8_t old = reg;
+	reg = value ? (old | bit) : (old & ~bit);
+	if (reg == old)
+		return;
+
+	if (portB && (GIMSK.value & _BV(PCIE1)) && (PCMSK1.value & bit)) {
+		++host_interrupts;
+		PCINT1_vect();
+	} else if (!portB && (GIMSK.value & _BV(PCIE0)) && (PCMSK0.value & bit)) {
+		++host_interrupts;
+		PCINT0_vect();
+	}
+}
+
+unsigned long millis() {
+	return host_time_us / 1000;
+}
+
+unsigned long micros() {
+	return host_time_us;
+}
+
+void delay(unsigned long ms) {
+	host_advance(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+	host_advance(us);
+}
+
+void (*host_twi_isr_probe)(const HostCost& cost) = nullptr;
+void (*host_atomic_probe)(const HostCost& cost) = nullptr;
+
+uint64_t host_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+HostCost host_cost_now() {
+	return {host_now_ns(), host_register_accesses};
+}
+
+HostCost host_cost_since(const HostCost& start) {
+	return {host_now_ns() - start.ns, host_register_accesses - start.accesses};
+}
+
+uint16_t host_read_tcnt1() {
+	return host_now_ns() * (F_CPU / 1000000) / 1000;
+}
+
+HostAtomicBlock::HostAtomicBlock() : startNs(host_now_ns()), startAccesses(host_register_accesses) { }
+
+HostAtomicBlock::~HostAtomicBlock() {
+	if (host_atomic_probe)
+		host_atomic_probe(host_cost_since({startNs, startAccesses}));
+}
+
+void wdt_enable(uint8_t /* timeout */) {
+	throw HostReset();
+}
+
+// Let the slave handle the currently flagged event and wait for it to
+// issue a command (acknowledge or complete) in TWSCRB. As long as it
+// does not, the bus is held and the stretch hook is called. Returns
+// true when the slave acknowledged.
+static bool twiService() {
+	for (unsigned tries = 0; ; ++tries) {
+		bool enabled = (TWSSRA.value & _BV(TWDIF)) ? (TWSCRA.value & _BV(TWDIE))
+		             : (TWSSRA.value & _BV(TWAS)) ? (TWSCRA.value & _BV(TWASIE))
+		             : (TWSCRA.value & _BV(TWSIE));
+		if (enabled) {
+			++host_interrupts;
+			HostCost start = host_cost_now();
+			TWI_SLAVE_vect();
+			if (host_twi_isr_probe)
+				host_twi_isr_probe(host_cost_since(start));
+		}
+
+		if (TWSCRB.value & (_BV(TWCMD1) | _BV(TWCMD0)))
+			break;
+
+		if (tries > 100000) {
+			fprintf(stderr, "TWI slave holds the bus forever\n");
+			abort();
+		}
+		host_twi_stretch();
+	}
+
+	bool ack = !(TWSCRB.value & _BV(TWAA));
+	TWSCRB.value &= ~(_BV(TWCMD1) | _BV(TWCMD0));
+	TWSSRA.value &= ~(_BV(TWDIF) | _BV(TWASIF) | _BV(TWBE) | _BV(TWC));
+	return ack;
+}
+
+bool host_twi_start(uint8_t address, bool read) {
+	if (!(TWSCRA.value & _BV(TWEN)))
+		return false;
+
+	uint8_t addr = TWSA.value >> 1;
+	uint8_t mask = TWSAM.value >> 1;
+	bool generalCall = (address == 0 && (TWSA.value & 1));
+	if (!generalCall && ((address ^ addr) & ~mask))
+		return false;
+
+	TWSD.value = (address << 1) | (read ? 1 : 0);
+	TWSSRA.value = _BV(TWASIF) | _BV(TWAS) | (read ? _BV(TWDIR) : 0);
+	return twiService();
+}
+
+bool host_twi_write(uint8_t data) {
+	TWSD.value = data;
+	TWSSRA.value = _BV(TWDIF);
+	return twiService();
+}
+
+uint8_t host_twi_read(bool ack) {
+	TWSSRA.value = _BV(TWDIF) | _BV(TWDIR);
+	twiService();
+	uint8_t data = TWSD.value;
+	if (!ack)
+		TWSSRA.value |= _BV(TWRA);
+	return data;
+}
+
+void host_twi_bus_error() {
+	TWSSRA.value = _BV(TWASIF) | _BV(TWBE) | (TWSSRA.value & _BV(TWDIR));
+	twiService();
+}
+
+void host_twi_stop() {
+	TWSSRA.value = _BV(TWASIF) | (TWSSRA.value & _BV(TWDIR));
+	twiService();
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host-side interface to the simulated hardware
+
+#pragma once
+
+#include <stdint.h>
+#include "Arduino.h"
+
+// Thrown when the firmware resets itself through the watchdog
+struct HostReset {};
+
+// Simulated time, in microseconds since startup. Only advances
+// through delay() and host_advance(), which also runs the timers and
+// fires their interrupts.
+extern uint64_t host_time_us;
+void host_advance(uint32_t us);
+
+// Pin state, indexed by Arduino pin number
+extern uint8_t host_pin_mode[NUM_DIGITAL_PINS];
+extern uint8_t host_pin_value[NUM_DIGITAL_PINS];
+
+// Changes the level of an input pin, as seen by digitalRead() and the
+// PINx registers, firing its pin change interrupt when enabled.
+void host_set_pin(uint8_t pin, uint8_t value);
+
+// Called by analogRead() and the ADC to produce a conversion result.
+// The default returns the middle of the scale.
+extern uint16_t (*host_adc_source)(uint8_t channel);
+
+// Simulated I²C master, driving the TWI slave registers. These return
+// false when the slave did not acknowledge.
+bool host_twi_start(uint8_t address, bool read);
+bool host_twi_write(uint8_t data);
+uint8_t host_twi_read(bool ack);
+void host_twi_stop();
+// Signals an illegal START/STOP condition to the slave
+void host_twi_bus_error();
+
+// Number of interrupts fired so far
+extern uint32_t host_interrupts;
+
+// Cost of firmware code: host time and register accesses (see
+// host_register_accesses in avr/io.h). Neither is an AVR cycle count,
+// but both grow with the work done, so they can be compared before and
+// after a change.
+struct HostCost {
+	uint64_t ns;
+	uint64_t accesses;
+};
+
+// Host time, also used to drive Timer1 (see TCNT1 in avr/io.h)
+uint64_t host_now_ns();
+
+// Returns the current time and access count, to pass to
+// host_cost_since() later.
+HostCost host_cost_now();
+HostCost host_cost_since(const HostCost& start);
+
+// When set, called with the cost of each call to TWI_SLAVE_vect and
+// each ATOMIC_BLOCK respectively.
+extern void (*host_twi_isr_probe)(const HostCost& cost);
+extern void (*host_atomic_probe)(const HostCost& cost);
+
+// Called when the slave holds the bus (clock stretching) until it
+// releases it again. Defaults to running loop().
+extern void (*host_twi_stretch)();
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host replacement for <avr/interrupt.h>. Interrupt handlers become
+// plain functions, which the host side calls to simulate an interrupt.
+
+#pragma once
+
+#include <avr/io.h>
+
+#define ISR(vector) extern "C" void vector(void)
+
+extern "C" void TWI_SLAVE_vect(void);
+extern "C" void TIMER2_COMPA_vect(void);
+extern "C" void ADC_vect(void);
+extern "C" void PCINT0_vect(void);
+extern "C" void PCINT1_vect(void);
+
+#define sei() (SREG |= 0x80)
+#define cli() (SREG &= ~0x80)
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host replacement for <avr/io.h>. Models the ATtiny841 registers
+// used by the firmware as variables, which the host side (see
+// Shim.cpp) can inspect and modify to simulate the hardware.
+
+#pragma once
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+#define RAMSTART 0x100
+#define RAMEND 0x2ff
+
+// Number of register reads and writes done by the firmware. Unlike
+// host time, this does not depend on the PC, so it is used by the
+// benchmark as a measure of the work done.
+extern uint64_t host_register_accesses;
+
+// A register that counts the accesses by the firmware. Read-modify-write
+// operators count as a read and a write, like on the AVR. The host side
+// of the shim uses value directly, which is not counted.
+template <typename T>
+struct HostRegister {
+	volatile T value;
+
+	operator T() const {
+		++host_register_accesses;
+		return value;
+	}
+
+	HostRegister &operator=(T v) {
+		++host_register_accesses;
+		value = v;
+		return *this;
+	}
+
+	// For chained assignments, which do not read the register again
+	HostRegister &operator=(const HostRegister &other) {
+		return *this = (T)other.value;
+	}
+
+	template <typename U> HostRegister &operator|=(U v) { return *this = *this | v; }
+	template <typename U> HostRegister &operator&=(U v) { return *this = *this & v; }
+	template <typename U> HostRegister &operator+=(U v) { return *this = *this + v; }
+};
+
+extern HostRegister<uint8_t> SREG;
+
+// Two-wire slave interface
+extern HostRegister<uint8_t> TWSCRA;
+extern HostRegister<uint8_t> TWSCRB;
+extern HostRegister<uint8_t> TWSSRA;
+extern HostRegister<uint8_t> TWSA;
+extern HostRegister<uint8_t> TWSAM;
+extern HostRegister<uint8_t> TWSD;
+
+#define TWSHE 7
+#define TWDIE 5
+#define TWASIE 4
+#define TWEN 3
+#define TWSIE 2
+#define TWPME 1
+#define TWSME 0
+
+#define TWHNM 3
+#define TWAA 2
+#define TWCMD1 1
+#define TWCMD0 0
+
+#define TWDIF 7
+#define TWASIF 6
+#define TWCH 5
+#define TWRA 4
+#define TWC 3
+#define TWBE 2
+#define TWDIR 1
+#define TWAS 0
+
+// Timer/counter 1 (16-bit). TCNT1 counts CPU cycles of host time,
+// as if running with prescaler 1, regardless of TCCR1B.
+extern HostRegister<uint8_t> TCCR1A;
+extern HostRegister<uint8_t> TCCR1B;
+uint16_t host_read_tcnt1();
+#define TCNT1 host_read_tcnt1()
+
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+// Timer/counter 2 (16-bit)
+extern HostRegister<uint8_t> TCCR2A;
+extern HostRegister<uint8_t> TCCR2B;
+extern HostRegister<uint16_t> TCNT2;
+extern HostRegister<uint16_t> OCR2A;
+extern HostRegister<uint8_t> TIMSK2;
+extern HostRegister<uint8_t> TIFR2;
+
+#define CS22 2
+#define CS21 1
+#define CS20 0
+
+#define OCIE2A 1
+#define TOIE2 0
+
+#define OCF2A 1
+#define TOV2 0
+
+// ADC
+extern HostRegister<uint8_t> ADCSRA;
+extern HostRegister<uint8_t> ADMUXA;
+extern HostRegister<uint8_t> ADMUXB;
+extern HostRegister<uint16_t> ADC;
+
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+// Port input registers and pin change interrupts. The shim updates
+// PINA/PINB from host_set_pin().
+extern HostRegister<uint8_t> PINA;
+extern HostRegister<uint8_t> PINB;
+extern HostRegister<uint8_t> GIMSK;
+extern HostRegister<uint8_t> PCMSK0;
+extern HostRegister<uint8_t> PCMSK1;
+
+#define PINA0 0
+#define PINA1 1
+#define PINA2 2
+#define PINA3 3
+#define PINA4 4
+#define PINA5 5
+#define PINA6 6
+#define PINA7 7
+
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+
+#define INT0 6
+#define PCIE1 5
+#define PCIE0 4
+
+#define PCINT0 0
+#define PCINT1 1
+#define PCINT2 2
+#define PCINT3 3
+#define PCINT4 4
+#define PCINT5 5
+#define PCINT6 6
+#define PCINT7 7
+#define PCINT8 0
+#define PCINT9 1
+#define PCINT10 2
+#define PCINT11 3
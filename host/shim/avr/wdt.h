@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host replacement for <avr/wdt.h>
+
+#pragma once
+
+#include <stdint.h>
+
+#define WDTO_15MS 0
+
+// Enabling the watchdog is only ever done to reset the chip, so this
+// does not return, but throws HostReset (see Shim.h).
+void wdt_enable(uint8_t timeout);
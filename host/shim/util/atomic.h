@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host replacement for <util/atomic.h>. Interrupts are only ever
+// "fired" by the host code between calls into the firmware, so
+// atomic blocks need no protection. Their cost is measured, though, to
+// find the longest time interrupts would be disabled (see Shim.h).
+
+#pragma once
+
+#include <stdint.h>
+
+struct HostAtomicBlock {
+	HostAtomicBlock();
+	~HostAtomicBlock();
+	explicit operator bool() const { return true; }
+
+	uint64_t startNs;
+	uint64_t startAccesses;
+};
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) if (HostAtomicBlock __atomic{})
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2017 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host replacement for <util/crc16.h>, using the C equivalents given
+// in the avr-libc documentation.
+
+#pragma once
+
+#include <stdint.h>
+
+static inline uint8_t _crc8_ccitt_update(uint8_t inCrc, uint8_t inData) {
+	uint8_t data = inCrc ^ inData;
+	for (uint8_t i = 0; i < 8; i++) {
+		if ((data & 0x80) != 0) {
+			data <<= 1;
+			data ^= 0x07;
+		} else {
+			data <<= 1;
+		}
+	}
+	return data;
+}